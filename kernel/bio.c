@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -16,76 +16,372 @@
 
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "memstat.h"
+
+// Buffers are found through a hash table on (dev, blockno),
+// each bucket with its own lock, so that looking up different
+// blocks doesn't serialize. A buffer with no references keeps
+// its block until it is recycled; the one recycled is roughly
+// the least recently released, by the time brelse() gave it up.
+//
+// Besides NBUF fixed buffers, which are enough for the log,
+// the cache grows a page of buffers at a time while it misses,
+// up to 1/BCACHEFRAC of the memory that was free at boot. When
+// kalloc() runs out of memory it calls bshrink(), which gives
+// back pages whose buffers are all unused.
+#define NBUCKET 251
+#define NSCAN   8     // buckets with unused buffers recycle() compares
+#define BPERPAGE ((PGSIZE - sizeof(struct bufpage*)) / sizeof(struct buf))
+
+struct bufpage {
+  struct bufpage *next;
+  struct buf buf[BPERPAGE];
+};
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;   // list of buffers, through prev/next
+};
 
 struct {
+  // serializes recycling, growing and shrinking, which are
+  // the only things that move buffers between buckets or give
+  // a buffer a new block.
   struct spinlock lock;
   struct buf buf[NBUF];
-
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bufpage *pages;  // pages of buffers the cache has grown
+  int npage;
+  int maxpage;
+  int hand;               // bucket recycle() looks at first
+  int nwait;              // processes in bget() looking for a free buffer
+  struct bucket bucket[NBUCKET];
+  struct bucket empty;    // buffers that have never held a block
 } bcache;
 
+#define NODEV ((uint)-1)  // dev of a buffer on bcache.empty
+
+static struct bucket*
+bucketof(uint dev, uint blockno)
+{
+  if(dev == NODEV)
+    return &bcache.empty;
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Caller holds bk->lock.
+static struct buf*
+lookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Caller holds bk->lock.
+static void
+insert(struct bucket *bk, struct buf *b)
+{
+  b->prev = 0;
+  b->next = bk->head;
+  if(b->next)
+    b->next->prev = b;
+  bk->head = b;
+}
+
+// Caller holds bk->lock, and b is on bk.
+static void
+unlink(struct bucket *bk, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+// Put b on bcache.empty.
+// Caller holds bcache.lock.
+static void
+addbuf(struct buf *b)
+{
+  struct bucket *bk = &bcache.empty;
+
+  b->dev = NODEV;
+  b->blockno = 0;
+  b->refcnt = 0;
+  b->lastuse = 0;
+  initsleeplock(&b->lock, "buffer");
+  acquire(&bk->lock);
+  insert(bk, b);
+  release(&bk->lock);
+}
+
 void
 binit(void)
 {
+  struct memstat st;
   struct buf *b;
+  struct bucket *bk;
+  uint64 nfree;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head = 0;
+  }
+  initlock(&bcache.empty.lock, "bcache.empty");
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++)
+    addbuf(b);
+
+  kmemstat(&st);
+  nfree = st.ncached;
+  for(int k = 0; k <= MAXORDER; k++)
+    nfree += st.nfree[k] << k;
+  bcache.maxpage = nfree / BCACHEFRAC;
+}
+
+// Add a page of buffers to the cache, if it is allowed more
+// and there is memory for one. Returns whether it did.
+// Caller holds bcache.lock but no bucket lock.
+static int
+grow(void)
+{
+  struct bufpage *pg;
+
+  if(bcache.npage >= bcache.maxpage || (pg = kalloc()) == 0)
+    return 0;
+  for(int i = 0; i < BPERPAGE; i++)
+    addbuf(&pg->buf[i]);
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.npage++;
+  return 1;
+}
+
+// Find an unused buffer for block blockno on dev, moving it
+// to bk, which must be that block's bucket. Returns it with a
+// reference, or 0 if every buffer is in use.
+// Prefers a buffer that has never held a block, then one from
+// a new page. Otherwise it recycles the least recently
+// released buffer in the first NSCAN buckets with unused
+// buffers, starting after where the last call stopped, rather
+// than looking through the whole cache.
+// Caller holds bcache.lock but no bucket lock.
+static struct buf*
+recycle(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b, *best = 0;
+  struct bucket *held = 0, *other;
+  int i, nseen = 0;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  if(bcache.empty.head || grow()){
+    held = &bcache.empty;
+    acquire(&held->lock);
+    best = held->head;
+    goto found;
   }
+
+  // keep holding the lock of the bucket that holds the best
+  // buffer so far, so that no one can take it. Only bcache.lock
+  // holders hold two bucket locks at once.
+  for(i = 0; i < NBUCKET && nseen < NSCAN; i++){
+    int better = 0, unused = 0;
+    other = &bcache.bucket[(bcache.hand + i) % NBUCKET];
+    acquire(&other->lock);
+    for(b = other->head; b; b = b->next){
+      if(b->refcnt != 0)
+        continue;
+      unused = 1;
+      if(best == 0 || b->lastuse < best->lastuse){
+        best = b;
+        better = 1;
+      }
+    }
+    nseen += unused;
+    if(better){
+      if(held)
+        release(&held->lock);
+      held = other;
+    } else {
+      release(&other->lock);
+    }
+  }
+  bcache.hand = (bcache.hand + i) % NBUCKET;
+  if(best == 0)
+    return 0;
+
+found:
+  if(held != bk){
+    unlink(held, best);
+    release(&held->lock);
+    acquire(&bk->lock);
+    insert(bk, best);
+  }
+  best->dev = dev;
+  best->blockno = blockno;
+  best->valid = 0;
+  best->refcnt = 1;
+  release(&bk->lock);
+  return best;
 }
 
 // Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// If not found, allocate a buffer, waiting for one if
+// all are in use.
+// In either case, return the buffer with a reference, but
+// not locked.
+// With ahead set, for read-ahead, return 0 instead if the
+// block is cached already or every buffer is in use.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(uint dev, uint blockno, int ahead)
 {
+  struct bucket *bk = bucketof(dev, blockno);
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
+  acquire(&bk->lock);
+  if((b = lookup(bk, dev, blockno)) != 0){
+    if(ahead)
+      b = 0;
+    else
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+    release(&bk->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached. Look again under bcache.lock, since another
+  // process may have recycled a buffer for it in between;
+  // after that no one else can.
+  acquire(&bcache.lock);
+  if(!ahead)
+    bcache.nwait++;
+  for(;;){
+    acquire(&bk->lock);
+    if((b = lookup(bk, dev, blockno)) != 0){
+      if(ahead)
+        b = 0;
+      else
+        b->refcnt++;
+      release(&bk->lock);
+      break;
     }
+    release(&bk->lock);
+
+    if((b = recycle(bk, dev, blockno)) != 0 || ahead)
+      break;
+
+    // every buffer is in use, and no more memory: wait for
+    // a brelse().
+    sleep(&bcache, &bcache.lock);
   }
+  if(!ahead)
+    bcache.nwait--;
+  release(&bcache.lock);
+  return b;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+// Return the locked buffer for block blockno on dev.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bfind(dev, blockno, 0);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Give back pages of unused buffers, when kalloc() is out of
+// memory. Returns how many pages it freed.
+int
+bshrink(void)
+{
+  struct bufpage *pg, **pp, *freed = 0;
+  struct bucket *locked[BPERPAGE];
+  int i, j, n, unused;
+
+  // kalloc() may be called under bcache.lock, e.g. by grow().
+  push_off();
+  if(holding(&bcache.lock) || !tryacquire(&bcache.lock)){
+    pop_off();
+    return 0;
+  }
+  pop_off();
+
+  for(pp = &bcache.pages; (pg = *pp) != 0; ){
+    // lock each bucket that pg's buffers are on, once.
+    n = 0;
+    for(i = 0; i < BPERPAGE; i++){
+      struct bucket *bk = bucketof(pg->buf[i].dev, pg->buf[i].blockno);
+      for(j = 0; j < n && locked[j] != bk; j++)
+        ;
+      if(j == n){
+        acquire(&bk->lock);
+        locked[n++] = bk;
+      }
+    }
+    unused = 1;
+    for(i = 0; i < BPERPAGE; i++)
+      unused &= (pg->buf[i].refcnt == 0);
+    if(unused){
+      for(i = 0; i < BPERPAGE; i++)
+        unlink(bucketof(pg->buf[i].dev, pg->buf[i].blockno), &pg->buf[i]);
+      *pp = pg->next;
+      pg->next = freed;
+      freed = pg;
+      bcache.npage--;
+    } else {
+      pp = &pg->next;
     }
+    for(j = 0; j < n; j++)
+      release(&locked[j]->lock);
+  }
+  release(&bcache.lock);
+
+  for(n = 0; freed; n++){
+    pg = freed;
+    freed = pg->next;
+    kfree(pg);
+  }
+  return n;
+}
+
+// Drop a reference to b. If it was the last, note when, for
+// recycle(), and wake anyone waiting for a free buffer.
+static void
+bput(struct buf *b)
+{
+  // b can't move to another bucket while we hold a reference.
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+  int last;
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  last = (b->refcnt == 0);
+  if(last)
+    b->lastuse = r_time();
+  release(&bk->lock);
+
+  // bget() counts itself in nwait under bcache.lock before it
+  // looks at any bucket, so if it missed b, nwait is set here,
+  // and taking bcache.lock waits until it is asleep.
+  __sync_synchronize();
+  if(last && bcache.nwait){
+    acquire(&bcache.lock);
+    wakeup(&bcache);
+    release(&bcache.lock);
   }
-  panic("bget: no buffers");
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +398,41 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Start reading block blockno on dev into the cache, unless
+// it is there already, and don't wait for it. For read-ahead,
+// so it gives up if the disk or the cache is busy.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bfind(dev, blockno, 1)) == 0)
+    return;
+  acquiresleep(&b->lock);
+  if(b->valid){
+    // someone found it before we locked it, and read it.
+    brelse(b);
+    return;
+  }
+  // the buffer stays locked, on behalf of the disk, until
+  // the read is done; bread()s of it wait until then.
+  disownsleep(&b->lock);
+  if(virtio_disk_read_async(b) < 0){
+    releasesleep(&b->lock);
+    bput(b);
+  }
+}
+
+// Called by the disk driver, from its interrupt, when a read
+// that breadahead() started is done.
+void
+bdone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -112,7 +443,6 @@ bwrite(struct buf *b)
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +450,19 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bucketof(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bput(b);
 }
-
-
@@ -5,7 +5,8 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint64 lastuse;   // when refcnt last went to 0, for recycling
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
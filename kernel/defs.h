@@ -8,6 +8,11 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct kmem_cache;
+struct vma;
+struct memstat;
+struct schedstat;
+struct tgroup;
 
 // bio.c
 void            binit(void);
@@ -16,6 +21,9 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            breadahead(uint, uint);
+void            bdone(struct buf*);
+int             bshrink(void);
 
 // console.c
 void            consoleinit(void);
@@ -41,6 +49,7 @@ struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit();
+int             ishrink(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
@@ -61,8 +70,15 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
+void*           kalloc_order(int);
+void            kfree_order(void*, int);
+void            kmemstat(struct memstat*);
+void*           kdup(void *);
 void            kfree(void *);
 void            kinit(void);
+int             krefcnt(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,6 +87,7 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -85,7 +102,8 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+int             clone(uint64, uint64, uint64);
+uint64          growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -96,12 +114,23 @@ struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+void            runnable(struct proc*);
+void            rebalance(void);
+void            boost(void);
+int             timeslice(void);
+int             setpriority(int, int);
+void            schedstat(struct schedstat*);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
+int             join(uint64);
+void            tlbshootdown(struct tgroup*);
+void            tgunmap(struct tgroup*, uint64, uint64);
 void            wakeup(void*);
+void            wakeup_one(void*);
+int             wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -110,19 +139,30 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            kmem_cache_flush(struct kmem_cache*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
+int             tryacquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             lockstat(uint64, int);
+void            lockwaited(struct spinlock*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+void            disownsleep(struct sleeplock*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -141,10 +181,21 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, uint);
+int             futexwake(uint64, int);
+
+// timer.c
+void            wheelinit(void);
+uint64          timerrun(void);
+int             timersleep(uint64);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
+void            ipi(int);
 extern struct spinlock tickslock;
 void            usertrapret(void);
 
@@ -164,15 +215,37 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmsplit(pagetable_t, uint64);
+void            uvmdetach(pagetable_t, uint64, uint64);
+void            uvmreap(pagetable_t, uint64, uint64);
+void            uvmwprotect(pagetable_t, uint64, uint64);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
+
+// vma.c
+void            vmainit(void);
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmaoverlap(struct proc*, uint64, uint64);
+char*           vmapage(struct vma*, uint64);
+void            textinval(struct inode*);
+void            textdrop(struct inode*);
+int             textshrink(void);
+int             vmadup(struct proc*, struct proc*);
+void            vmafree(struct vma*);
+void            vmatrim(struct proc*, uint64);
+void            vmaprefault(uint64, uint64);
+uint64          mmapbase(struct proc*);
+uint64          mmap(struct inode*, uint64, int, int, uint);
+int             munmap(uint64, uint64);
+void            munmapall(pagetable_t, struct vma*);
 
 // plic.c
 void            plicinit(void);
@@ -183,6 +256,7 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_read_async(struct buf *);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -5,10 +5,11 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -23,13 +24,25 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma vma[NVMA], *v;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+
+  // the other threads would be left running the old program.
+  acquire(&tg->lock);
+  if(tg->ref > 1){
+    release(&tg->lock);
+    return -1;
+  }
+  release(&tg->lock);
+
+  memset(vma, 0, sizeof(vma));
 
   begin_op();
 
@@ -49,7 +62,9 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record each program segment. Nothing is read yet;
+  // vmfault() loads a page from ip when the program
+  // first touches it.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,19 +76,33 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(ph.vaddr + ph.memsz >= MMAPTOP)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    for(v = vma; v < &vma[nvma]; v++){
+      if(ph.vaddr < PGROUNDUP(v->end) && v->start < ph.vaddr + ph.memsz)
+        goto bad;  // segments overlap.
+    }
+    if(nvma >= NVMA)
       goto bad;
+    v = &vma[nvma++];
+    v->start = ph.vaddr;
+    v->end = ph.vaddr + ph.memsz;
+    v->perm = PTE_R | PTE_U | flags2perm(ph.flags);
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v->gen = ip->gen;
+    if(v->end > sz)
+      sz = v->end;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = tg->sz;
 
   // Allocate some pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -122,11 +151,22 @@ exec(char *path, char **argv)
     
   // Commit to the user image.
   oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
+  p->pagetable = tg->pagetable = pagetable;
+  p->tfva = TRAPFRAME;
+  tg->tfslots = 1;
+  tg->sz = sz;
+  for(i = 0; i < NVMA; i++){
+    struct vma tmp = tg->vma[i];
+    tg->vma[i] = vma[i];
+    vma[i] = tmp;
+  }
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  munmapall(oldpagetable, vma);
   proc_freepagetable(oldpagetable, oldsz);
+  begin_op();
+  vmafree(vma);  // the old image's regions.
+  end_op();
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -134,33 +174,13 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
+    vmafree(vma);
     iunlockput(ip);
     end_op();
+  } else {
+    begin_op();
+    vmafree(vma);
+    end_op();
   }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -18,6 +18,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // itable's list of cached inodes
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,6 +28,14 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  // sequential read-ahead, for readi().
+  uint ranext;        // block a sequential reader would read next
+  uint raend;         // blocks before this have been read ahead
+  uint rawin;         // blocks to read ahead; 0 if not sequential
+
+  uint gen;           // bumped each time the contents change
+  int text;           // it may have pages in the text cache
 };
 
 // map major device number to device functions.
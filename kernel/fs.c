@@ -22,6 +22,11 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+
+// read-ahead window, in blocks: where it starts when readi()
+// sees a file read sequentially, and how far it doubles to.
+#define RAMIN 4
+#define RAMAX 32
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -117,7 +122,9 @@ bfree(int dev, uint b)
 //
 // The kernel keeps a table of in-use inodes in memory
 // to provide a place for synchronizing access
-// to inodes used by multiple processes. The in-memory
+// to inodes used by multiple processes. The table is a
+// list of inodes allocated from a slab cache, so the
+// number of inodes in use is limited only by memory. The in-memory
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->valid.
 //
@@ -129,18 +136,20 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref is zero stays in the table, so that
+//   the next iget() of it needn't read it from disk again;
+//   it is only freed when memory runs low (ishrink()), or
+//   reused by iget() when no new entry can be allocated.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid. A new table entry
+//   starts out with ip->valid clear.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,29 +173,27 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
+// The itable.lock spin-lock protects the list of itable
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those
+// fields, or ip->next.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and next.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *inode;      // list of cached inodes
+  struct kmem_cache *cache;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -201,6 +208,7 @@ ialloc(uint dev, short type)
   int inum;
   struct buf *bp;
   struct dinode *dip;
+  struct inode *ip;
 
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
@@ -208,9 +216,13 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if((ip = iget(dev, inum)) == 0){
+        brelse(bp);
+        return 0;
+      }
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
-      return iget(dev, inum);
+      return ip;
     }
     brelse(bp);
   }
@@ -243,6 +255,7 @@ iupdate(struct inode *ip)
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
+// Returns 0 if out of memory.
 static struct inode*
 iget(uint dev, uint inum)
 {
@@ -252,30 +265,75 @@ iget(uint dev, uint inum)
 
   // Is the inode already in the table?
   empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.inode; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
+    if(ip->ref == 0)    // remember the last unused entry.
       empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Add a new entry, or else recycle an unused one.
+  if((ip = kmem_cache_alloc(itable.cache)) != 0){
+    initsleeplock(&ip->lock, "inode");
+    ip->next = itable.inode;
+    itable.inode = ip;
+  } else if((ip = empty) == 0){
+    release(&itable.lock);
+    printf("iget: no inodes\n");
+    return 0;
+  } else {
+    textdrop(ip);
+  }
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->rawin = 0;
+  ip->gen = 0;
+  ip->text = 0;
   release(&itable.lock);
 
   return ip;
 }
 
+// Free the table entries of unused inodes, when kalloc() is
+// out of memory. Returns how many it freed.
+int
+ishrink(void)
+{
+  struct inode *ip, **pp;
+  int n;
+
+  // kalloc() may be called under itable.lock, by iget().
+  push_off();
+  if(holding(&itable.lock) || !tryacquire(&itable.lock)){
+    pop_off();
+    return 0;
+  }
+  pop_off();
+
+  n = 0;
+  for(pp = &itable.inode; (ip = *pp) != 0; ){
+    if(ip->ref == 0){
+      textdrop(ip);
+      *pp = ip->next;
+      kmem_cache_free(itable.cache, ip);
+      n++;
+    } else {
+      pp = &ip->next;
+    }
+  }
+  release(&itable.lock);
+  if(n > 0)
+    kmem_cache_flush(itable.cache);
+  return n;
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
@@ -327,8 +385,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry stays
+// cached until it is recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -429,6 +487,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  textinval(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -449,6 +509,7 @@ itrunc(struct inode *ip)
   }
 
   ip->size = 0;
+  ip->ranext = ip->raend = ip->rawin = 0;
   iupdate(ip);
 }
 
@@ -464,6 +525,39 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Called by readi() after it has read up to block last of ip,
+// having started at block first. If the file is being read
+// sequentially, start reading the next blocks from the disk
+// so that they're cached by the time they're asked for. The
+// window doubles, up to RAMAX blocks, for as long as the reads
+// stay sequential, and closes when one isn't.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, addr;
+
+  if(first == ip->ranext || first + 1 == ip->ranext){
+    // continues where the last read stopped, or rereads its
+    // last, partly read, block.
+    ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  } else {
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->ranext = last + 1;
+  if(ip->rawin == 0)
+    return;
+
+  end = min(last + 1 + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  for(bn = ip->raend > last + 1 ? ip->raend : last + 1; bn < end; bn++){
+    if((addr = bmap(ip, bn)) == 0)
+      break;
+    breadahead(ip->dev, addr);
+  }
+  ip->raend = bn;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -492,6 +586,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  if((int)tot > 0)
+    readahead(ip, (off - tot) / BSIZE, (off - 1) / BSIZE);
   return tot;
 }
 
@@ -512,6 +608,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(ip->type == T_FILE && n > 0)
+    textinval(ip);  // it may be a running program.
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -547,11 +645,12 @@ namecmp(const char *s, const char *t)
 }
 
 // Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// If found, set *poff to byte offset of entry and
+// return its inode number; otherwise return 0.
+static uint
+dirfind(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off;
   struct dirent de;
 
   if(dp->type != T_DIR)
@@ -566,14 +665,26 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       // entry matches path element
       if(poff)
         *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      return de.inum;
     }
   }
 
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Returns 0 if not found, or if out of memory.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum;
+
+  if((inum = dirfind(dp, name, poff)) == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 // Returns 0 on success, -1 on failure (e.g. out of disk blocks).
 int
@@ -581,13 +692,10 @@ dirlink(struct inode *dp, char *name, uint inum)
 {
   int off;
   struct dirent de;
-  struct inode *ip;
 
   // Check that name is not present.
-  if((ip = dirlookup(dp, name, 0)) != 0){
-    iput(ip);
+  if(dirfind(dp, name, 0) != 0)
     return -1;
-  }
 
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
@@ -653,10 +761,15 @@ namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
-  if(*path == '/')
-    ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  if(*path == '/'){
+    if((ip = iget(ROOTDEV, ROOTINO)) == 0)
+      return 0;
+  } else {
+    struct tgroup *tg = myproc()->tg;
+    acquire(&tg->lock);
+    ip = idup(tg->cwd);
+    release(&tg->lock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
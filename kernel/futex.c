@@ -0,0 +1,171 @@
+// Futexes: sleeping and waking on a word of user memory, for
+// user-level locks and condition variables.
+//
+// futexwait(addr, val) sleeps only if the word at addr still
+// holds val, and futexwake(addr, n) wakes up to n of the
+// processes sleeping on addr. Waiters meet on a key: for a
+// private word, the thread group and the word's virtual
+// address, which stay the same when a copy-on-write fault
+// moves the word to another page; for a word in a MAP_SHARED
+// region, which other processes may map at other addresses,
+// its physical address. Each waiter is on the list of one of
+// NFUTEX queues, hashed by key; holding the queue's lock from
+// the check of the word until the sleep means that a wake
+// after the word changed can't be missed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+
+#define NFUTEX 64
+
+// A process in futexwait(), on its kernel stack.
+struct waiter {
+  struct tgroup *tg;    // 0 for a word in a MAP_SHARED region
+  uint64 key;           // the word's virtual or physical address
+  int woken;
+  struct waiter *next;
+};
+
+struct futexq {
+  struct spinlock lock;
+  struct waiter *head;
+} futexq[NFUTEX];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct futexq*
+futexqof(struct tgroup *tg, uint64 key)
+{
+  uint64 a = key ^ (uint64)tg;
+
+  return &futexq[((a >> 2) ^ (a >> 12)) % NFUTEX];
+}
+
+// Find the key for the user word at addr, and what it holds.
+// Returns -1 if its page isn't mapped.
+// Caller holds p->tg->lock.
+static int
+futexkey(struct proc *p, uint64 addr, struct tgroup **tg, uint64 *key, uint *val)
+{
+  struct vma *v;
+  uint64 pa;
+
+  if((pa = walkaddr(p->pagetable, PGROUNDDOWN(addr))) == 0)
+    return -1;
+  pa += addr % PGSIZE;
+  *val = *(volatile uint*)pa;
+  if((v = vmalookup(p, addr)) != 0 && v->flags == MAP_SHARED){
+    *tg = 0;
+    *key = pa;
+  } else {
+    *tg = p->tg;
+    *key = addr;
+  }
+  return 0;
+}
+
+// Lock and return the queue for the user word at addr, which
+// is mapped, and fill in its key and what it holds. Returns 0
+// if addr isn't a valid, aligned, user address.
+static struct futexq*
+futexlock(uint64 addr, struct tgroup **tg, uint64 *key, uint *val)
+{
+  struct proc *p = myproc();
+  struct futexq *q;
+  struct tgroup *tg1;
+  uint64 key1;
+  int r;
+
+  if(addr % sizeof(uint) != 0 || addr >= MAXVA)
+    return 0;
+  for(;;){
+    acquire(&p->tg->lock);
+    r = futexkey(p, addr, tg, key, val);
+    release(&p->tg->lock);
+    if(r < 0){
+      if(vmfault(p->pagetable, PGROUNDDOWN(addr), 1) == 0)
+        return 0;
+      continue;
+    }
+    // look again with the queue locked, in case the page
+    // went away in between.
+    q = futexqof(*tg, *key);
+    acquire(&q->lock);
+    acquire(&p->tg->lock);
+    r = futexkey(p, addr, &tg1, &key1, val);
+    release(&p->tg->lock);
+    if(r == 0 && tg1 == *tg && key1 == *key)
+      return q;
+    release(&q->lock);
+  }
+}
+
+// Sleep on the word at addr if it holds val.
+// Returns 0 when woken, or -1 if the word held something
+// else, addr is bad, or the process was killed.
+int
+futexwait(uint64 addr, uint val)
+{
+  struct proc *p = myproc();
+  struct futexq *q;
+  struct waiter w, **pp;
+  uint now;
+
+  if((q = futexlock(addr, &w.tg, &w.key, &now)) == 0)
+    return -1;
+  if(now != val || killed(p)){
+    release(&q->lock);
+    return -1;
+  }
+  w.woken = 0;
+  w.next = q->head;
+  q->head = &w;
+  while(!w.woken && !killed(p))
+    sleep(&w, &q->lock);
+  if(!w.woken){
+    for(pp = &q->head; *pp != &w; pp = &(*pp)->next)
+      ;
+    *pp = w.next;
+  }
+  release(&q->lock);
+  return w.woken ? 0 : -1;
+}
+
+// Wake up to n processes sleeping on the word at addr.
+// Returns how many were woken, or -1 if addr is bad.
+int
+futexwake(uint64 addr, int n)
+{
+  struct futexq *q;
+  struct tgroup *tg;
+  struct waiter *w, **pp;
+  uint64 key;
+  uint val;
+  int woken = 0;
+
+  if((q = futexlock(addr, &tg, &key, &val)) == 0)
+    return -1;
+  for(pp = &q->head; (w = *pp) != 0 && woken < n; ){
+    if(w->tg == tg && w->key == key){
+      *pp = w->next;
+      w->woken = 1;
+      wakeup(w);
+      woken++;
+    } else {
+      pp = &w->next;
+    }
+  }
+  release(&q->lock);
+  return woken;
+}
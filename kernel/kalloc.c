@@ -1,14 +1,51 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// and physically contiguous blocks of 2^order pages.
+//
+// Free memory lives in a buddy allocator: a free list of
+// blocks for each order from 0 to MAXORDER, where a block of
+// order k is 2^k pages aligned to its own size. Allocating
+// splits a larger block if need be, and freeing merges a
+// block with its buddy whenever the buddy is free too.
+//
+// Each CPU also keeps its own list of free single pages so
+// that the common kalloc()/kfree() path only touches a lock
+// that no other CPU normally wants. A CPU whose list runs
+// dry refills it KBATCH pages at a time from the buddy
+// allocator, and a CPU whose list grows past KCPUMAX spills
+// KBATCH pages back. If the buddy allocator is empty too,
+// kalloc() steals half of some other CPU's list rather than
+// failing.
+//
+// kalloc_zeroed() hands out pages from a pool of pages that
+// were zeroed ahead of time by CPUs with nothing else to do
+// (see kzerofill()), so that page tables and user memory
+// usually don't have to be cleared on the allocation path.
+//
+// Pages may be shared, e.g. between a parent and child after
+// a copy-on-write fork(), so each page has a reference count.
+// kalloc() returns a page with a count of one, kdup() adds a
+// reference, and kfree() only frees a page once its last
+// reference is dropped.
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "memstat.h"
 #include "defs.h"
 
+#define KBATCH   32   // pages moved between a CPU and the buddy allocator
+#define KCPUMAX 128   // max pages cached on one CPU's free list
+#define NZERO   256   // pages to keep in the zero pool
+#define KZEROLOW 1024 // free pages below which kzerofill() stops
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(pg) ((void*)(KERNBASE + (uint64)(pg) * PGSIZE))
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,48 +55,376 @@ struct run {
   struct run *next;
 };
 
-struct {
+// a free block in the buddy allocator.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+struct kmemcpu {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+struct {
+  struct spinlock lock;   // protects the buddy allocator and stats
+  struct block *free[MAXORDER+1];
+  uint64 nblock[MAXORDER+1];
+  char order[NPAGE];      // 1 + order of the free block starting at
+                          // each page, or 0 if no free block does.
+  struct memstat stat;
+  struct kmemcpu cpu[NCPU];
 } kmem;
 
+// free pages that are already zero-filled.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  uint64 nhit;    // kalloc_zeroed() calls served from the pool
+  uint64 nmiss;   // ... that had to zero a page
+} kzero;
+
+// reference counts, indexed by physical page number.
+// updated with atomic instructions rather than under a lock.
+int kref[NPAGE];
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kmem cpu");
   freerange(end, (void*)PHYSTOP);
 }
 
+static void bfree(void *pa, int order);
+
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    bfree(p, 0);
+  release(&kmem.lock);
+}
+
+// Add the free block of 2^order pages at page pg to
+// the buddy allocator's lists. Caller holds kmem.lock.
+static void
+bpush(uint64 pg, int order)
+{
+  struct block *b = PG2PA(pg);
+
+  b->prev = 0;
+  b->next = kmem.free[order];
+  if(b->next)
+    b->next->prev = b;
+  kmem.free[order] = b;
+  kmem.order[pg] = order + 1;
+  kmem.nblock[order]++;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Take the free block at page pg off its list.
+// Caller holds kmem.lock.
+static void
+bremove(uint64 pg, int order)
+{
+  struct block *b = PG2PA(pg);
+
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    kmem.free[order] = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+  kmem.order[pg] = 0;
+  kmem.nblock[order]--;
+}
+
+// Return a block of 2^order pages to the buddy allocator,
+// merging it with its buddy for as long as that is free.
+// Caller holds kmem.lock.
+static void
+bfree(void *pa, int order)
+{
+  uint64 pg, buddy;
+
+  pg = PA2PG(pa);
+  while(order < MAXORDER){
+    buddy = pg ^ (1L << order);
+    if(buddy >= NPAGE || kmem.order[buddy] != order + 1)
+      break;
+    bremove(buddy, order);
+    pg &= ~(1L << order);
+    order++;
+  }
+  bpush(pg, order);
+}
+
+// Allocate a block of 2^order pages, splitting a larger
+// block if there is no free block of the right size.
+// Caller holds kmem.lock.
+static void*
+balloc(int order)
+{
+  uint64 pg;
+  int k;
+
+  for(k = order; k <= MAXORDER && kmem.free[k] == 0; k++)
+    ;
+  if(k > MAXORDER)
+    return 0;
+  pg = PA2PG(kmem.free[k]);
+  bremove(pg, k);
+  while(k > order){
+    // give back the upper half.
+    k--;
+    bpush(pg + (1L << k), k);
+  }
+  return PG2PA(pg);
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain and stores its length in *got.
+static struct run*
+takepages(struct run **list, int n, int *got)
+{
+  struct run *first, *last;
+  int i;
+
+  first = *list;
+  if(first == 0 || n <= 0){
+    *got = 0;
+    return 0;
+  }
+  last = first;
+  for(i = 1; i < n && last->next; i++)
+    last = last->next;
+  *list = last->next;
+  last->next = 0;
+  *got = i;
+  return first;
+}
+
+// Find pages for CPU id, whose own list is empty: first a
+// batch from the buddy allocator, then half of some other
+// CPU's list. Called without any kmem lock held, so that
+// stealing never holds two per-CPU locks at once.
+static struct run*
+krefill(int id, int *got)
+{
+  struct run *r, *head;
+  struct kmemcpu *kc;
+
+  head = 0;
+  *got = 0;
+  acquire(&kmem.lock);
+  while(*got < KBATCH && (r = balloc(0)) != 0){
+    r->next = head;
+    head = r;
+    (*got)++;
+  }
+  kmem.stat.nrefill++;
+  release(&kmem.lock);
+  if(head)
+    return head;
+
+  for(int i = 1; i < NCPU; i++){
+    kc = &kmem.cpu[(id + i) % NCPU];
+    acquire(&kc->lock);
+    r = takepages(&kc->freelist, (kc->nfree + 1) / 2, got);
+    kc->nfree -= *got;
+    release(&kc->lock);
+    if(r){
+      acquire(&kmem.lock);
+      kmem.stat.nsteal++;
+      release(&kmem.lock);
+      return r;
+    }
+  }
+  return 0;
+}
+
+// Give every CPU's cached pages, and the zero pool's pages,
+// back to the buddy allocator, so that they can merge into
+// larger blocks.
+static void
+kdrain(void)
+{
+  struct run *r, *list;
+  struct kmemcpu *kc;
+  int n;
+
+  acquire(&kzero.lock);
+  list = kzero.list;
+  kzero.list = 0;
+  kzero.n = 0;
+  release(&kzero.lock);
+  acquire(&kmem.lock);
+  while((r = list) != 0){
+    list = r->next;
+    bfree(r, 0);
+  }
+  release(&kmem.lock);
+
+  for(kc = kmem.cpu; kc < &kmem.cpu[NCPU]; kc++){
+    acquire(&kc->lock);
+    list = takepages(&kc->freelist, kc->nfree, &n);
+    kc->nfree = 0;
+    release(&kc->lock);
+
+    acquire(&kmem.lock);
+    while((r = list) != 0){
+      list = r->next;
+      bfree(r, 0);
+    }
+    release(&kmem.lock);
+  }
+}
+
+// Take a page from the zero pool, or return 0 if it's empty.
+// The page is all zeroes, but its reference count is still 0.
+// Counts a hit in *nhit, if nhit isn't 0.
+static struct run*
+kzerotake(uint64 *nhit)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.list;
+  if(r){
+    kzero.list = r->next;
+    kzero.n--;
+    if(nhit)
+      (*nhit)++;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;
+  return r;
+}
+
+// Add a reference to the page of physical memory pointed
+// at by pa, which must have been returned by kalloc().
+// Returns pa.
+void *
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&kref[PA2PG(pa)], 1) < 1)
+    panic("kdup: free page");
+  return pa;
+}
+
+// Return the number of references to the page at pa.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref[PA2PG(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc().
+// The page is freed when its last reference goes away.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *spill;
+  struct kmemcpu *kc;
+  int n, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&kref[PA2PG(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  spill = 0;
+  if(kc->nfree > KCPUMAX){
+    spill = takepages(&kc->freelist, KBATCH, &n);
+    kc->nfree -= n;
+  }
+  release(&kc->lock);
+
+  if(spill){
+    acquire(&kmem.lock);
+    while((r = spill) != 0){
+      spill = r->next;
+      bfree(r, 0);
+    }
+    release(&kmem.lock);
+  }
+  pop_off();
+}
+
+// Out of memory: ask the kernel's caches to give some back.
+// Returns nonzero if any of them freed something.
+static int
+kreclaim(void)
+{
+  return bshrink() > 0 || ishrink() > 0 || textshrink() > 0;
+}
+
+// Take a free page from this CPU's list, refilling the list
+// if it's empty. Doesn't set the page's reference count.
+// Returns 0 if there are no free pages.
+static struct run*
+kget(void)
+{
+  struct run *r, *rest;
+  struct kmemcpu *kc;
+  int id, n;
+
+  push_off();
+  id = cpuid();
+  kc = &kmem.cpu[id];
+  acquire(&kc->lock);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+
+  if(r == 0 && (r = krefill(id, &n)) != 0){
+    // keep the first page, cache the rest of the batch.
+    rest = r->next;
+    if(rest){
+      struct run *last = rest;
+      while(last->next)
+        last = last->next;
+      acquire(&kc->lock);
+      last->next = kc->freelist;
+      kc->freelist = rest;
+      kc->nfree += n - 1;
+      release(&kc->lock);
+    }
+  }
+  pop_off();
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,13 +435,190 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  r = kget();
+  if(r == 0)
+    r = kzerotake(0);
+  if(r == 0 && kreclaim())
+    return kalloc();   // last resort: a cache gave some back.
 
-  if(r)
+  if(r){
+    kref[PA2PG(r)] = 1;
+#ifdef KALLOC_JUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
   return (void*)r;
 }
+
+// Allocate one zero-filled 4096-byte page of physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = kzerotake(&kzero.nhit)) != 0){
+    kref[PA2PG(r)] = 1;
+    return (void*)r;
+  }
+  if((r = kalloc()) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+  acquire(&kzero.lock);
+  kzero.nmiss++;
+  release(&kzero.lock);
+  return (void*)r;
+}
+
+// About how many free pages there are outside the zero pool.
+// Reads the per-CPU counts without their locks.
+static uint64
+kfreepages(void)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < NCPU; i++)
+    n += __atomic_load_n(&kmem.cpu[i].nfree, __ATOMIC_RELAXED);
+  acquire(&kmem.lock);
+  for(int k = 0; k <= MAXORDER; k++)
+    n += kmem.nblock[k] << k;
+  release(&kmem.lock);
+  return n;
+}
+
+// Called by the scheduler when this CPU has nothing to run:
+// zero one free page and add it to the zero pool.
+// Returns 1 if it did, or 0 if the pool is full or there
+// is no free memory to spare. Takes only pages that are
+// plainly free: never from the pool itself, and never by
+// making the caches give memory back.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(__atomic_load_n(&kzero.n, __ATOMIC_RELAXED) >= NZERO ||
+     kfreepages() < KZEROLOW)
+    return 0;
+  if((r = kget()) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  r->next = kzero.list;
+  kzero.list = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their total size. Each page starts with a reference count
+// of one. Returns 0 if no large enough block is free.
+void *
+kalloc_order(int order)
+{
+  uint64 t0;
+  void *pa;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  t0 = r_time();
+  acquire(&kmem.lock);
+  pa = balloc(order);
+  release(&kmem.lock);
+  if(pa == 0){
+    // the pages cached on CPUs' lists and in the zero pool
+    // may be free, or complete a block.
+    kdrain();
+    acquire(&kmem.lock);
+    pa = balloc(order);
+    release(&kmem.lock);
+  }
+  if(pa == 0 && kreclaim()){
+    // last resort, as in kalloc(). the caches free their
+    // pages to this CPU's list, so drain it again.
+    kdrain();
+    acquire(&kmem.lock);
+    pa = balloc(order);
+    release(&kmem.lock);
+  }
+
+  acquire(&kmem.lock);
+  if(pa)
+    kmem.stat.nalloc[order]++;
+  else
+    kmem.stat.nfail[order]++;
+  kmem.stat.time[order] += r_time() - t0;
+  release(&kmem.lock);
+
+  if(pa){
+    for(uint64 pg = PA2PG(pa); pg < PA2PG(pa) + (1L << order); pg++)
+      kref[pg] = 1;
+#ifdef KALLOC_JUNK
+    memset(pa, 5, PGSIZE << order); // fill with junk
+#endif
+  }
+  return pa;
+}
+
+// Drop a reference to the block of 2^order pages at pa,
+// which must have come from kalloc_order(order), and free
+// the block when the reference count of its first page
+// goes to zero.
+void
+kfree_order(void *pa, int order)
+{
+  int ref;
+
+  if(order < 0 || order > MAXORDER ||
+     ((uint64)pa - KERNBASE) % (PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  ref = __sync_sub_and_fetch(&kref[PA2PG(pa)], 1);
+  if(ref < 0)
+    panic("kfree_order: ref");
+  if(ref > 0)
+    return;
+  for(uint64 pg = PA2PG(pa) + 1; pg < PA2PG(pa) + (1L << order); pg++)
+    kref[pg] = 0;
+
+#ifdef KALLOC_JUNK
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  bfree(pa, order);
+  release(&kmem.lock);
+}
+
+// Fill in *st with the allocator's free block counts and
+// statistics, for the memstat() system call.
+void
+kmemstat(struct memstat *st)
+{
+  struct kmemcpu *kc;
+  uint64 ncached = 0;
+
+  for(kc = kmem.cpu; kc < &kmem.cpu[NCPU]; kc++){
+    acquire(&kc->lock);
+    ncached += kc->nfree;
+    release(&kc->lock);
+  }
+
+  acquire(&kmem.lock);
+  *st = kmem.stat;
+  for(int k = 0; k <= MAXORDER; k++)
+    st->nfree[k] = kmem.nblock[k];
+  release(&kmem.lock);
+  st->ncached = ncached;
+
+  acquire(&kzero.lock);
+  st->nzero = kzero.n;
+  st->nzerohit = kzero.nhit;
+  st->nzeromiss = kzero.nmiss;
+  release(&kzero.lock);
+}
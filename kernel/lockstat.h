@@ -0,0 +1,17 @@
+// spinlock statistics, from lockstat(), one per lock name:
+// all the locks initlock() gave the same name are counted
+// together, e.g. every inode's or every pipe's.
+#define NLOCKSTAT 64
+#define LOCKNAME  16
+
+struct lockstat {
+  char name[LOCKNAME];
+  uint64 nacquire;  // times acquired
+  uint64 ncontend;  // times acquire() found it held
+  uint64 nspin;     // times acquire() looked at it again while waiting
+  uint64 maxhold;   // longest time held, in timer cycles
+
+  // for a sleep lock's spinlock, which has the sleep lock's name:
+  uint64 nsleep;    // times acquiresleep() found it held and slept
+  uint64 nspinwait; // times it found it held, but spun instead of sleeping
+};
@@ -17,16 +17,21 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small kernel object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
     trapinit();      // trap vectors
+    wheelinit();     // sleep timers
+    futexinit();     // user-level sleep and wakeup
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    vmainit();       // shared text page cache
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
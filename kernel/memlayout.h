@@ -25,6 +25,15 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
+// core local interruptor (CLINT). writing 1 to a hart's
+// MSIP register raises a machine-mode software interrupt
+// on that hart.
+#define CLINT 0x02000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
+
+// qemu's real-time counter, the time CSR, counts at 10 MHz.
+#define TIMEFREQ 10000000L
+
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -54,6 +63,10 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
-//   TRAPFRAME (p->trapframe, used by the trampoline)
+//   mmap()ed files, allocated downward from MMAPTOP
+//   a trapframe per thread (p->trapframe, used by the trampoline),
+//     the first at TRAPFRAME and the others below it
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define TFSLOT(i) (TRAPFRAME - (i)*PGSIZE)
+#define MMAPTOP TFSLOT(NTHREAD-1)
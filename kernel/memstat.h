@@ -0,0 +1,13 @@
+// physical memory allocator statistics, from memstat().
+struct memstat {
+  uint64 nfree[MAXORDER+1];  // free blocks of each order
+  uint64 ncached;            // free pages on per-CPU lists
+  uint64 nrefill;            // per-CPU list refills from the buddy allocator
+  uint64 nsteal;             // refills stolen from another CPU
+  uint64 nzero;              // pages in the zero pool
+  uint64 nzerohit;           // kalloc_zeroed() calls served from the pool
+  uint64 nzeromiss;          // kalloc_zeroed() calls that zeroed a page
+  uint64 nalloc[MAXORDER+1]; // successful kalloc_order() calls
+  uint64 nfail[MAXORDER+1];  // failed kalloc_order() calls
+  uint64 time[MAXORDER+1];   // total kalloc_order() time, in timer cycles
+};
@@ -1,15 +1,21 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // disk block cache buffers that are always there
+#define BCACHEFRAC   8     // disk block cache may grow to 1/BCACHEFRAC of free memory
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define USERSTACK    1     // user stack pages
+#define NTHREAD      16    // threads per process
+#define NVMA         16    // file-backed memory regions per process
+#define MAXORDER     10    // largest physical block is 2^MAXORDER pages
+#define MEGAHEAP     (4*1024*1024)  // smallest heap that gets 2 MB megapages
+#define NPRIO        3     // scheduler priority levels
+#define BOOSTTICKS   10    // clock ticks between priority boosts
+#define TICKTIME     1000000  // timer cycles per clock tick (about 100 ms)
 
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "schedstat.h"
 
 struct cpu cpus[NCPU];
 
@@ -12,6 +13,8 @@ struct proc proc[NPROC];
 
 struct proc *initproc;
 
+struct kmem_cache *tgcache;
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
@@ -43,14 +46,66 @@ proc_mapstacks(pagetable_t kpgtbl)
   }
 }
 
+// Per-CPU queues of RUNNABLE processes. A process waits on the
+// queue of the CPU it last ran on, so that each scheduler()
+// looks only at its own queue instead of every p->lock.
+// An idle CPU steals from the busiest queue, and each CPU's
+// timer interrupt pushes work from a long queue to a short one.
+// Lock order: p->lock, then a runq lock.
+//
+// Each queue is a multi-level feedback queue: NPRIO FIFOs,
+// 0 the highest priority. A process that uses up its time
+// slice, SLICE(prio) clock ticks, drops a level; one that
+// sleeps before then keeps its level. Every BOOSTTICKS ticks
+// each CPU moves its queued processes back up to the highest
+// level their nice value allows, so that nothing starves.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];  // next to run at each level
+  struct proc *tail[NPRIO];
+  int n;                     // number of queued processes
+  int online;                // this CPU has entered scheduler()
+  int idle;                  // this CPU is in wfi, or about to be
+  uint lastboost;            // ticks at the last priority boost
+  struct schedstat stat;
+} runq[NCPU];
+
+#define SLICE(prio) (1 << (prio))
+
+// Wait queues for sleep() and wakeup(), hashed by channel,
+// so that wakeup() looks only at processes that might be
+// asleep on its channel. Lock order: a sleepq lock, then
+// p->lock.
+#define NSLEEPQ 64
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;  // sleepers, oldest first
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+sleepqof(void *chan)
+{
+  uint64 a = (uint64)chan;
+
+  return &sleepq[((a >> 3) ^ (a >> 12)) % NSLEEPQ];
+}
+
 // initialize the proc table.
 void
 procinit(void)
 {
   struct proc *p;
+  struct runq *rq;
+  struct sleepq *q;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  tgcache = kmem_cache_create("tgroup", sizeof(struct tgroup));
+  for(rq = runq; rq < &runq[NCPU]; rq++)
+    initlock(&rq->lock, "runq");
+  for(q = sleepq; q < &sleepq[NSLEEPQ]; q++)
+    initlock(&q->lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -102,12 +157,129 @@ allocpid()
   return pid;
 }
 
+// Map p's trapframe into a free slot of tg's page table.
+// Caller holds tg->lock.
+// Returns 0, or -1 if tg has NTHREAD threads or out of memory.
+static int
+tfmap(struct tgroup *tg, struct proc *p)
+{
+  int i;
+
+  for(i = 0; i < NTHREAD; i++)
+    if((tg->tfslots & (1 << i)) == 0)
+      break;
+  if(i == NTHREAD)
+    return -1;
+  if(mappages(tg->pagetable, TFSLOT(i), PGSIZE,
+              (uint64)p->trapframe, PTE_R | PTE_W) < 0)
+    return -1;
+  tg->tfslots |= 1 << i;
+  p->tfva = TFSLOT(i);
+  return 0;
+}
+
+// Caller holds tg->lock.
+static void
+tfunmap(struct tgroup *tg, struct proc *p)
+{
+  uvmunmap(tg->pagetable, p->tfva, 1, 0);
+  tg->tfslots &= ~(1 << ((TRAPFRAME - p->tfva) / PGSIZE));
+}
+
+// A new thread group for p, with an empty user page table.
+static struct tgroup*
+tgalloc(struct proc *p)
+{
+  struct tgroup *tg;
+
+  if((tg = kmem_cache_alloc(tgcache)) == 0)
+    return 0;
+  memset(tg, 0, sizeof(*tg));
+  initlock(&tg->lock, "tgroup");
+  if((tg->pagetable = proc_pagetable(p)) == 0){
+    kmem_cache_free(tgcache, tg);
+    return 0;
+  }
+  tg->ref = 1;
+  tg->tfslots = 1;
+  p->tfva = TRAPFRAME;
+  return tg;
+}
+
+// Drop p's reference to its thread group. The last one
+// frees the group's page table and user memory; its files
+// and regions must be gone already, see exit().
+static void
+tgput(struct proc *p)
+{
+  struct tgroup *tg = p->tg;
+  int last;
+
+  acquire(&tg->lock);
+  tfunmap(tg, p);
+  last = --tg->ref == 0;
+  release(&tg->lock);
+  if(last){
+    proc_freepagetable(tg->pagetable, tg->sz);
+    kmem_cache_free(tgcache, tg);
+  }
+  p->tg = 0;
+  p->pagetable = 0;
+}
+
+// The caller just unmapped or write-protected pages in tg's
+// page table. Other CPUs running tg's threads in user space
+// may still have the old translations in their TLBs, so
+// interrupt them and wait until they have trapped, which
+// switches page tables and flushes the TLB.
+// The caller must not free the pages until this returns;
+// see tgunmap().
+// Caller holds tg->lock.
+void
+tlbshootdown(struct tgroup *tg)
+{
+  struct cpu *c;
+  struct proc *pp;
+  uint n;
+
+  __sync_synchronize();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c == mycpu())
+      continue;
+    n = c->ntrap;
+    __sync_synchronize();
+    if(!c->inuser || (pp = c->proc) == 0 || pp->tg != tg)
+      continue;
+    ipi(c - cpus);
+    while(c->ntrap == n && c->inuser)
+      ;
+  }
+}
+
+// Unmap npages starting at va from tg's page table, and free
+// the pages, but only once no other CPU's TLB can refer to
+// them, since a thread could otherwise store into a page
+// that has been given to someone else.
+// Caller holds tg->lock.
+void
+tgunmap(struct tgroup *tg, uint64 va, uint64 npages)
+{
+  if(tg->ref == 1){
+    uvmunmap(tg->pagetable, va, npages, 1);
+    return;
+  }
+  uvmdetach(tg->pagetable, va, npages);
+  tlbshootdown(tg);
+  uvmreap(tg->pagetable, va, npages);
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. The new process is a thread
+// of group tg, or, if tg is 0, the only thread of a new group.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct tgroup *tg)
 {
   struct proc *p;
 
@@ -124,6 +296,10 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->cpu = -1;
+  p->nice = 0;
+  p->prio = 0;
+  p->ticks = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,13 +308,26 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(tg == 0){
+    // An empty user page table.
+    if((tg = tgalloc(p)) == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+  } else {
+    acquire(&tg->lock);
+    if(tfmap(tg, p) < 0){
+      release(&tg->lock);
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    tg->ref++;
+    release(&tg->lock);
   }
+  p->tg = tg;
+  p->pagetable = tg->pagetable;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -158,10 +347,10 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
+  if(p->tg)
+    tgput(p);
+  p->thread = 0;
+  p->ustack = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -194,7 +383,7 @@ proc_pagetable(struct proc *p)
   }
 
   // map the trapframe page just below the trampoline page, for
-  // trampoline.S.
+  // trampoline.S. threads added by clone() map theirs below.
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
@@ -210,8 +399,13 @@ proc_pagetable(struct proc *p)
 void
 proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
+  pte_t *pte;
+
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  for(int i = 0; i < NTHREAD; i++){
+    if((pte = walk(pagetable, TFSLOT(i), 0)) != 0 && (*pte & PTE_V))
+      uvmunmap(pagetable, TFSLOT(i), 1, 0);
+  }
   uvmfree(pagetable, sz);
 }
 
@@ -234,44 +428,60 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
   // and data into it.
   uvmfirst(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  p->tg->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
   p->trapframe->sp = PGSIZE;  // user stack pointer
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  p->tg->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  runnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Growing only reserves address space; vmfault() gives
+// the process a zeroed page when it first touches one.
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint64 sz;
+  uint64 sz, oldsz;
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
 
-  sz = p->sz;
+  acquire(&tg->lock);
+  sz = oldsz = tg->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n < sz || sz + n > mmapbase(p)){
+      release(&tg->lock);
+      return -1;
+    }
+    sz += n;
+  } else if(n < 0 && sz + n < sz){
+    // a megapage that would be cut in two must be split
+    // first, or the shrink fails.
+    if(uvmsplit(p->pagetable, PGROUNDUP(sz + n)) < 0){
+      release(&tg->lock);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if(PGROUNDUP(sz + n) < PGROUNDUP(sz))
+      tgunmap(tg, PGROUNDUP(sz + n), (PGROUNDUP(sz) - PGROUNDUP(sz + n)) / PGSIZE);
+    sz += n;
+    vmatrim(p, sz);
   }
-  p->sz = sz;
-  return 0;
+  tg->sz = sz;
+  release(&tg->lock);
+  return oldsz;
 }
 
 // Create a new process, copying the parent.
@@ -284,17 +494,36 @@ fork(void)
   struct proc *p = myproc();
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child. the parent's
+  // other threads may be using it meanwhile.
+  acquire(&p->tg->lock);
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->tg->sz, 0) < 0){
+    release(&p->tg->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->tg->sz = p->tg->sz;
+  if(vmadup(np, p) < 0){
+    release(&p->tg->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  // the parent's writable pages are now copy-on-write.
+  if(p->tg->ref > 1)
+    tlbshootdown(p->tg);
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->tg->ofile[i])
+      np->tg->ofile[i] = filedup(p->tg->ofile[i]);
+  np->tg->cwd = idup(p->tg->cwd);
+  release(&p->tg->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -302,29 +531,98 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  np->nice = p->nice;
+  np->prio = np->nice;
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  runnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a thread of the current process, sharing its memory,
+// open files and current directory. The thread starts by
+// calling fn(arg) on the user stack whose top is stack, and
+// must call exit() rather than return from fn.
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if(stack % 16 != 0)
+    return -1;
+
+  // Allocate a thread of p's group.
+  if((np = allocproc(p->tg)) == 0){
+    return -1;
+  }
+
+  // start from the caller's registers, so that gp and
+  // tp are the same.
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  np->trapframe->ra = 0;
+  np->ustack = stack;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->nice = p->nice;
+  np->prio = np->nice;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->thread = 1;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  runnable(np);
   release(&np->lock);
 
   return pid;
 }
 
+// Take p out of its thread group, for exit(), unless p is
+// the group's last thread. Returns 1 if it is: then p must
+// release the group's files and regions, and freeproc()
+// frees the rest.
+static int
+tgleave(struct proc *p)
+{
+  struct tgroup *tg = p->tg;
+
+  acquire(&tg->lock);
+  if(tg->ref == 1){
+    release(&tg->lock);
+    return 1;
+  }
+  tfunmap(tg, p);
+  tg->ref--;
+  release(&tg->lock);
+  p->tg = 0;
+  p->pagetable = 0;
+  return 0;
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -335,6 +633,7 @@ reparent(struct proc *p)
   for(pp = proc; pp < &proc[NPROC]; pp++){
     if(pp->parent == p){
       pp->parent = initproc;
+      pp->thread = 0;  // init reaps it with wait().
       wakeup(initproc);
     }
   }
@@ -343,27 +642,44 @@ reparent(struct proc *p)
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
+// A thread exits alone, and its parent join()s it;
+// when a process's first thread exits, the others
+// are killed.
 void
 exit(int status)
 {
   struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+  struct proc *pp;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
+  if(!p->thread){
+    for(pp = proc; pp < &proc[NPROC]; pp++){
+      if(pp != p && pp->tg == tg)
+        kill(pp->pid);
     }
   }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+  if(tgleave(p)){
+    // Close all open files.
+    for(int fd = 0; fd < NOFILE; fd++){
+      if(tg->ofile[fd]){
+        struct file *f = tg->ofile[fd];
+        fileclose(f);
+        tg->ofile[fd] = 0;
+      }
+    }
+
+    munmapall(tg->pagetable, tg->vma);
+
+    begin_op();
+    iput(tg->cwd);
+    vmafree(tg->vma);
+    end_op();
+    tg->cwd = 0;
+  }
 
   acquire(&wait_lock);
 
@@ -385,14 +701,19 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child to exit and return its pid: a child
+// process, for wait(), or a thread, for join(). Copy the
+// process's exit status, or the stack given to clone() for
+// the thread, to addr.
+// Return -1 if this process has no such children.
+static int
+reap(int thread, uint64 addr)
 {
   struct proc *pp;
   int havekids, pid;
   struct proc *p = myproc();
+  void *src;
+  int n;
 
   acquire(&wait_lock);
 
@@ -400,7 +721,7 @@ wait(uint64 addr)
     // Scan through table looking for exited children.
     havekids = 0;
     for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+      if(pp->parent == p && pp->thread == thread){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -408,8 +729,9 @@ wait(uint64 addr)
         if(pp->state == ZOMBIE){
           // Found one.
           pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
+          src = thread ? (void*)&pp->ustack : (void*)&pp->xstate;
+          n = thread ? sizeof(pp->ustack) : sizeof(pp->xstate);
+          if(addr != 0 && copyout(p->pagetable, addr, src, n) < 0) {
             release(&pp->lock);
             release(&wait_lock);
             return -1;
@@ -434,10 +756,339 @@ wait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+wait(uint64 addr)
+{
+  return reap(0, addr);
+}
+
+// Wait for a thread this thread clone()d to exit and
+// return its pid.
+// Return -1 if this thread has no such threads.
+int
+join(uint64 addr)
+{
+  return reap(1, addr);
+}
+
+// Append p to the FIFO for its priority in rq.
+// Caller holds rq->lock.
+static void
+append(struct runq *rq, struct proc *p)
+{
+  int k = p->prio;
+
+  p->rqnext = 0;
+  if(rq->tail[k])
+    rq->tail[k]->rqnext = p;
+  else
+    rq->head[k] = p;
+  rq->tail[k] = p;
+}
+
+// Add p to CPU id's run queue.
+static void
+enqueue(struct proc *p, int id)
+{
+  struct runq *rq = &runq[id];
+
+  acquire(&rq->lock);
+  append(rq, p);
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Put p back at the head of its level on CPU id's run
+// queue, as if it had never been dequeued.
+static void
+pushfront(struct proc *p, int id)
+{
+  struct runq *rq = &runq[id];
+  int k = p->prio;
+
+  acquire(&rq->lock);
+  p->rqnext = rq->head[k];
+  rq->head[k] = p;
+  if(rq->tail[k] == 0)
+    rq->tail[k] = p;
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Remove and return the oldest process of the highest
+// priority on CPU id's run queue, or 0 if it is empty.
+static struct proc*
+dequeue(int id)
+{
+  struct runq *rq = &runq[id];
+  struct proc *p = 0;
+
+  acquire(&rq->lock);
+  for(int k = 0; k < NPRIO; k++){
+    if((p = rq->head[k]) != 0){
+      rq->head[k] = p->rqnext;
+      if(rq->head[k] == 0)
+        rq->tail[k] = 0;
+      rq->n--;
+      p->rqnext = 0;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// The online CPU with the shortest run queue, for a
+// process that hasn't run anywhere yet. The counts are
+// read without locks; a stale answer only costs balance.
+static int
+leastloaded(void)
+{
+  int best = cpuid();
+
+  for(int i = 0; i < NCPU; i++)
+    if(runq[i].online && runq[i].n < runq[best].n)
+      best = i;
+  return best;
+}
+
+// A process was just queued on CPU id. If id is idle, wake
+// it with an interrupt to run the process now, rather than
+// at its next timer. Otherwise wake some other idle CPU,
+// which will steal the process if id is still busy.
+static void
+kick(int id)
+{
+  int self = cpuid();
+
+  // pairs with the fence in idle(): either we see the
+  // CPU idle, or it sees the queued process.
+  __sync_synchronize();
+  if(runq[id].idle){
+    if(id != self)
+      ipi(id);
+    return;
+  }
+  for(int i = 0; i < NCPU; i++){
+    if(i != self && i != id && runq[i].idle){
+      ipi(i);
+      return;
+    }
+  }
+}
+
+// Take the oldest process from the busiest other CPU's
+// run queue, for CPU id to run since its own is empty.
+static struct proc*
+steal(int id)
+{
+  struct proc *p;
+  int victim = -1;
+
+  for(int i = 0; i < NCPU; i++)
+    if(i != id && runq[i].n > 0 && (victim < 0 || runq[i].n > runq[victim].n))
+      victim = i;
+  if(victim < 0 || (p = dequeue(victim)) == 0)
+    return 0;
+  runq[id].stat.nsteal++;
+  return p;
+}
+
+// Called from each CPU's timer interrupt. If this CPU's run
+// queue is more than one longer than the shortest online
+// queue, move the process at its head over there.
+void
+rebalance(void)
+{
+  int id = cpuid();
+  int best = id;
+  struct proc *p;
+
+  for(int i = 0; i < NCPU; i++)
+    if(runq[i].online && runq[i].n < runq[best].n)
+      best = i;
+  if(runq[id].n <= runq[best].n + 1)
+    return;
+  if((p = dequeue(id)) == 0)
+    return;
+  enqueue(p, best);
+  kick(best);
+  runq[id].stat.npush++;
+}
+
+// Called from each CPU's timer interrupt. Every BOOSTTICKS
+// ticks, raise every process on this CPU's run queue to the
+// highest priority its nice value allows.
+void
+boost(void)
+{
+  struct runq *rq = &runq[cpuid()];
+  struct proc *p, *next;
+
+  if(ticks - rq->lastboost < BOOSTTICKS)
+    return;
+  acquire(&rq->lock);
+  rq->lastboost = ticks;
+  for(int k = 1; k < NPRIO; k++){
+    p = rq->head[k];
+    rq->head[k] = rq->tail[k] = 0;
+    for(; p; p = next){
+      next = p->rqnext;
+      p->prio = p->nice;
+      p->ticks = 0;
+      append(rq, p);
+    }
+  }
+  release(&rq->lock);
+}
+
+// Charge the current process for a clock tick. Returns 1 if
+// it should give up the CPU: either it has used up its time
+// slice, and so drops a level, or a process of higher
+// priority is waiting on this CPU's run queue.
+int
+timeslice(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq = &runq[cpuid()];
+  int k;
+
+  if(++p->ticks >= SLICE(p->prio)){
+    p->ticks = 0;
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    return 1;
+  }
+  for(k = 0; k < p->prio; k++)
+    if(rq->head[k])
+      break;
+  return k < p->prio;
+}
+
+// Set the nice value of the process with the given pid:
+// the highest priority level, 0 to NPRIO-1, it may run at.
+// Takes effect the next time it is queued.
+int
+setpriority(int pid, int nice)
+{
+  struct proc *p;
+
+  if(nice < 0 || nice >= NPRIO)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->nice = nice;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Copy every CPU's scheduler statistics to st[0..NCPU-1].
+void
+schedstat(struct schedstat *st)
+{
+  for(int i = 0; i < NCPU; i++){
+    st[i] = runq[i].stat;
+    st[i].online = runq[i].online;
+    st[i].nqueued = runq[i].n;
+  }
+}
+
+// Make p RUNNABLE and queue it on the CPU it last ran on,
+// or on the least loaded CPU if it has never run.
+// Caller must hold p->lock.
+void
+runnable(struct proc *p)
+{
+  int id;
+
+  if(!holding(&p->lock))
+    panic("runnable");
+  p->state = RUNNABLE;
+  if(p->prio < p->nice)
+    p->prio = p->nice;
+  id = p->cpu >= 0 ? p->cpu : leastloaded();
+  enqueue(p, id);
+  if(p != myproc())  // a yield() is about to run someone anyway.
+    kick(id);
+}
+
+// Nothing to run on CPU id: wait for an interrupt. An idle
+// CPU doesn't tick; its timer goes off only for its next
+// sleep timer, and other CPUs kick() it when there is work.
+static void
+idle(int id)
+{
+  struct runq *rq = &runq[id];
+  uint64 next;
+  int i;
+
+  // with interrupts off, nothing can be queued here without
+  // kick() seeing rq->idle; wfi still wakes up for an
+  // interrupt that is pending.
+  intr_off();
+  rq->idle = 1;
+  __sync_synchronize();
+  next = timerrun();
+  for(i = 0; i < NCPU; i++)
+    if(runq[i].n > 0)
+      break;
+  if(i == NCPU){
+    w_stimecmp(next);
+    asm volatile("wfi");
+
+    // tick again: an immediate clock interrupt brings
+    // ticks up to date and asks for the next tick.
+    mycpu()->nexttick = 0;
+    w_stimecmp(0);
+  }
+  rq->idle = 0;
+  intr_on();
+}
+
+// Make p, which must be RUNNABLE and locked, the process
+// running on CPU id.
+static void
+dispatch(struct proc *p, int id)
+{
+  if(p->state != RUNNABLE)
+    panic("dispatch");
+  if(p->cpu != id){
+    if(p->cpu >= 0)
+      runq[id].stat.nmigrate++;
+    p->cpu = id;
+  }
+  runq[id].stat.nrun++;
+  p->state = RUNNING;
+  mycpu()->proc = p;
+}
+
+// Called by a process that was just switched to directly
+// from another in sched(): the other's context is saved
+// now, so its lock can go.
+static void
+finishswitch(void)
+{
+  struct cpu *c = mycpu();
+  struct proc *prev = c->prev;
+
+  if(prev){
+    c->prev = 0;
+    release(&prev->lock);
+  }
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take the process at the head of this CPU's run queue,
+//    or steal one from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -446,64 +1097,88 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
 
   c->proc = 0;
+  runq[id].online = 1;
   for(;;){
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
     // processes are waiting.
     intr_on();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    if((p = dequeue(id)) != 0 || (p = steal(id)) != 0){
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      dispatch(p, id);
+      swtch(&c->context, &p->context);
+
+      // A process is done running for now; not necessarily p,
+      // which may have switched straight to another in sched().
+      // It should have changed its p->state before coming back.
+      p = c->proc;
+      c->proc = 0;
       release(&p->lock);
-    }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      intr_on();
-      asm volatile("wfi");
+    } else if(kzerofill() == 0) {
+      // nothing to run, and no free pages left to zero for
+      // kalloc_zeroed(); stop running on this core until an interrupt.
+      idle(id);
     }
   }
 }
 
-// Switch to scheduler.  Must hold only p->lock
-// and have changed proc->state. Saves and restores
-// intena because intena is a property of this
-// kernel thread, not this CPU. It should
+// Switch to the next process on this CPU's run queue, or
+// to the scheduler if there is none or its lock is busy.
+// Must hold only p->lock and have changed proc->state.
+// Switching straight to the next process saves a trip
+// through the scheduler's context; the next process
+// releases p->lock once p's context is saved.
+// Saves and restores intena because intena is a property
+// of this kernel thread, not this CPU. It should
 // be proc->intena and proc->noff, but that would
 // break in the few places where a lock is held but
 // there's no process.
 void
 sched(void)
 {
-  int intena;
+  int intena, id;
   struct proc *p = myproc();
+  struct cpu *c = mycpu();
+  struct proc *next;
 
   if(!holding(&p->lock))
     panic("sched p->lock");
-  if(mycpu()->noff != 1)
+  if(c->noff != 1)
     panic("sched locks");
   if(p->state == RUNNING)
     panic("sched running");
   if(intr_get())
     panic("sched interruptible");
 
-  intena = mycpu()->intena;
-  swtch(&p->context, &mycpu()->context);
+  intena = c->intena;
+  id = cpuid();
+  next = dequeue(id);
+  if(next == p){
+    // p yielded, but nothing else here wants to run.
+    p->state = RUNNING;
+    return;
+  }
+  if(next && !tryacquire(&next->lock)){
+    pushfront(next, id);
+    next = 0;
+  }
+  if(next){
+    dispatch(next, id);
+    c->prev = p;
+    swtch(&p->context, &next->context);
+  } else {
+    swtch(&p->context, &c->context);
+  }
+
+  // running again, perhaps on another CPU.
+  finishswitch();
   mycpu()->intena = intena;
 }
 
@@ -513,7 +1188,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  runnable(p);
   sched();
   release(&p->lock);
 }
@@ -525,7 +1200,9 @@ forkret(void)
 {
   static int first = 1;
 
-  // Still holding p->lock from scheduler.
+  // Still holding p->lock from scheduler or sched(),
+  // and perhaps the lock of the process sched() switched from.
+  finishswitch();
   release(&myproc()->lock);
 
   if (first) {
@@ -548,20 +1225,29 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = sleepqof(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once p is on chan's wait queue, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the queue, then p->lock),
   // so it's okay to release lk.
 
-  acquire(&p->lock);  //DOC: sleeplock1
-  release(lk);
+  acquire(&q->lock);  //DOC: sleeplock1
+  acquire(&p->lock);
 
-  // Go to sleep.
+  // Go to sleep, behind any earlier sleepers.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = 0;
+  for(pp = &q->head; *pp; pp = &(*pp)->sqnext)
+    ;
+  *pp = p;
+
+  release(&q->lock);
+  release(lk);
 
   sched();
 
@@ -573,22 +1259,51 @@ sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Wake up to n of the processes sleeping on chan, oldest
+// first. Returns how many there were.
+// Must be called without any p->lock.
+int
+wakeupn(void *chan, int n)
+{
+  struct sleepq *q = sleepqof(chan);
+  struct proc **pp, *p;
+  int woken = 0;
+
+  acquire(&q->lock);
+  pp = &q->head;
+  while(woken < n && (p = *pp) != 0){
+    if(p->chan != chan){
+      pp = &p->sqnext;
+      continue;
+    }
+    *pp = p->sqnext;
+    acquire(&p->lock);
+    if(p->state != SLEEPING)
+      panic("wakeup");
+    runnable(p);
+    release(&p->lock);
+    woken++;
+  }
+  release(&q->lock);
+  return woken;
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeupn(chan, NPROC);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-    }
-  }
+// Wake up the process that has slept longest on chan,
+// for callers that can only let one of them proceed;
+// that one must pass the wakeup on if it doesn't use it.
+// Must be called without any p->lock.
+void
+wakeup_one(void *chan)
+{
+  wakeupn(chan, 1);
 }
 
 // Kill the process with the given pid.
@@ -597,17 +1312,32 @@ wakeup(void *chan)
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, **pp;
+  struct sleepq *q;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      chan = (p->state == SLEEPING) ? p->chan : 0;
       release(&p->lock);
+      if(chan){
+        // Wake process from sleep(), taking chan's wait
+        // queue lock first; it may have woken meanwhile.
+        q = sleepqof(chan);
+        acquire(&q->lock);
+        for(pp = &q->head; *pp; pp = &(*pp)->sqnext){
+          if(*pp == p){
+            *pp = p->sqnext;
+            acquire(&p->lock);
+            runnable(p);
+            release(&p->lock);
+            break;
+          }
+        }
+        release(&q->lock);
+      }
       return 0;
     }
     release(&p->lock);
@@ -24,6 +24,10 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 nexttick;            // Timer value of this CPU's next clock tick.
+  struct proc *prev;          // Switched directly from; release its lock.
+  volatile int inuser;        // Running c->proc in user space?
+  volatile uint ntrap;        // Traps from user space so far, for tlbshootdown().
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +85,41 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of a process's address space whose pages are read
+// from a file the first time the process touches them, e.g.
+// a program segment that exec() recorded but didn't load.
+struct vma {
+  uint64 start;        // first virtual address, page-aligned
+  uint64 end;          // one past the last virtual address
+  int perm;            // PTE_R, PTE_W, PTE_X, PTE_U for its pages
+  struct inode *ip;    // backing file; 0 if this slot is free
+  uint off;            // offset in ip of the byte at start
+  uint filesz;         // bytes that come from ip; the rest are zero
+  int flags;           // MAP_SHARED or MAP_PRIVATE for mmap(); 0 for exec()
+  uint gen;            // ip->gen when exec() recorded the segment
+};
+
+// What the threads of a process share: its user memory,
+// open files and current directory. fork() gives the child
+// a copy; clone() gives the new thread a reference.
+struct tgroup {
+  struct spinlock lock;
+
+  // lock must be held when using these:
+  int ref;                     // Threads in the group
+  int nfault;                  // Threads reading a region's file in vmfault()
+  uint64 unmapstart;           // [unmapstart, unmapend) is being munmap()ed;
+  uint64 unmapend;             //   faults in it fail. 0 if none.
+  uint tfslots;                // Trapframe slots in use, one bit each
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vma vma[NVMA];        // Demand-paged regions of user memory
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+
+  // only exec() changes this, and only with one thread:
+  pagetable_t pagetable;       // User page table
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -88,20 +127,29 @@ struct proc {
   // p->lock must be held when using these:
   enum procstate state;        // Process state
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *sqnext;         // Next asleep on chan's wait queue (sleepq lock)
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU p last ran on, or -1
+  int nice;                    // Highest priority level p may run at
+  struct proc *rqnext;         // Next on that run queue (runq lock)
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  int thread;                  // Created by clone(); reaped by join()
+
+  // owned by the CPU running p, or its runq lock while queued:
+  int prio;                    // Run queue level, 0 is highest
+  int ticks;                   // Clock ticks used of this level's slice
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct tgroup *tg;           // Memory and files, shared with p's threads
+  pagetable_t pagetable;       // User page table, tg->pagetable
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 tfva;                 // trapframe's user virtual address
+  uint64 ustack;               // Stack given to clone(), for join()
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 };
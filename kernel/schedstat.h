@@ -0,0 +1,9 @@
+// per-CPU scheduler statistics, from schedstat().
+struct schedstat {
+  uint64 online;    // this CPU is running scheduler()
+  uint64 nqueued;   // processes on its run queue now
+  uint64 nrun;      // processes it has switched to
+  uint64 nsteal;    // processes it took from another CPU's queue while idle
+  uint64 npush;     // processes rebalance() moved off its queue
+  uint64 nmigrate;  // times it ran a process that last ran elsewhere
+};
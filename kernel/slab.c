@@ -0,0 +1,217 @@
+// Slab allocator for small, fixed-size kernel objects
+// such as pipes, open files and in-memory inodes.
+//
+// A cache hands out objects of a single size, carved out of
+// whole pages ("slabs") from kalloc(). Each slab starts with
+// a struct slab header followed by as many objects as fit;
+// its free objects are chained through their first word.
+// The slab an object belongs to is the page it lies in.
+//
+// Each CPU keeps a magazine of free objects for each cache,
+// so that most allocations and frees don't touch the cache's
+// lock. An empty magazine is refilled, and a full one half
+// emptied, MAGSIZE/2 objects at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define MAGSIZE 16  // free objects cached per CPU per cache
+#define NCACHE   8  // max number of caches
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // cache's list of slabs with free objects
+  struct slab *prev;
+  void *free;         // chain of free objects
+  int inuse;          // number of allocated objects
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;             // object size
+  int perslab;           // objects per slab
+  struct spinlock lock;  // protects the slabs
+  struct slab *partial;  // slabs with at least one free object
+  int nslab;             // slabs in use
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+} slabs;
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Create a cache of objects of size bytes.
+// Panics if there are too many caches.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  for(c = slabs.cache; c < &slabs.cache[NCACHE]; c++){
+    if(c->name == 0){
+      c->name = name;
+      c->size = size;
+      c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+      initlock(&c->lock, name);
+      release(&slabs.lock);
+      return c;
+    }
+  }
+  panic("kmem_cache_create: no caches");
+}
+
+static void
+slabunlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Take an object from one of c's slabs, allocating a
+// new slab if none has a free object.
+// Caller holds c->lock.
+static void*
+slaballoc(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = c->partial) == 0){
+    if((s = (struct slab*)kalloc()) == 0)
+      return 0;
+    s->cache = c;
+    s->inuse = 0;
+    s->free = 0;
+    obj = (char*)s + sizeof(struct slab) + (c->perslab - 1) * c->size;
+    for(; obj >= (char*)s + sizeof(struct slab); obj -= c->size){
+      *(void**)obj = s->free;
+      s->free = obj;
+    }
+    s->prev = 0;
+    s->next = 0;
+    c->partial = s;
+    c->nslab++;
+  }
+
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  if(s->free == 0)
+    slabunlink(c, s);  // now full.
+  return obj;
+}
+
+// Return obj to its slab, and free the slab if nothing in
+// it is allocated any more, unless it's c's last one.
+// Caller holds c->lock.
+static void
+slabfree(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("kmem_cache_free");
+  if(s->free == 0){
+    // was full.
+    s->prev = 0;
+    s->next = c->partial;
+    if(s->next)
+      s->next->prev = s;
+    c->partial = s;
+  }
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->inuse--;
+  if(s->inuse == 0 && (c->partial != s || s->next != 0)){
+    slabunlink(c, s);
+    c->nslab--;
+    kfree(s);
+  }
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (obj = slaballoc(c)) != 0)
+      m->obj[m->n++] = obj;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Free obj, which must have come from kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+#ifdef KALLOC_JUNK
+  // Fill with junk to catch dangling refs.
+  memset(obj, 1, c->size);
+#endif
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabfree(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
+
+// Give this CPU's free objects of cache c back to their
+// slabs, so that slabs left empty go back to kalloc().
+void
+kmem_cache_flush(struct kmem_cache *c)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&c->lock);
+  while(m->n > 0)
+    slabfree(c, m->obj[--m->n]);
+  release(&c->lock);
+  pop_off();
+}
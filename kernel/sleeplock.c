@@ -9,24 +9,73 @@
 #include "proc.h"
 #include "sleeplock.h"
 
+// How many times acquiresleep() looks at a lock whose holder
+// is running before it gives up and sleeps.
+#define SPINLIMIT 10000
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
-  initlock(&lk->lk, "sleep lock");
+  // the spinlock takes the sleep lock's name, so that
+  // lockstat() reports each kind of sleep lock by itself.
+  initlock(&lk->lk, name);
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
+}
+
+// The lock is now held on behalf of no process, e.g. of a
+// disk read in progress; whoever finishes with it calls
+// releasesleep(). acquiresleep() won't spin waiting for it.
+void
+disownsleep(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  lk->pid = 0;
+  lk->owner = 0;
+  release(&lk->lk);
+}
+
+// Is p running on a CPU? p->lock isn't held, so this is
+// only a guess, which is all that acquiresleep() needs.
+static int
+oncpu(struct proc *p)
+{
+  return *(volatile enum procstate*)&p->state == RUNNING;
 }
 
+// Acquire the lock. If it is held by a process that is
+// running on another CPU, spin for a while first, since the
+// holder will often release it sooner than a sleep() and
+// wakeup() could be done: many ilock()s and buffer locks are
+// held only while memory is copied.
 void
 acquiresleep(struct sleeplock *lk)
 {
+  struct proc *owner;
+  int spins = 0, slept = 0;
+
   acquire(&lk->lk);
   while (lk->locked) {
-    sleep(lk, &lk->lk);
+    owner = lk->owner;
+    if(spins < SPINLIMIT && owner && oncpu(owner)){
+      release(&lk->lk);
+      while(spins < SPINLIMIT && *(volatile uint*)&lk->locked &&
+            *(struct proc *volatile*)&lk->owner == owner && oncpu(owner))
+        spins++;
+      spins++;
+      acquire(&lk->lk);
+    } else {
+      sleep(lk, &lk->lk);
+      slept = 1;
+    }
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
+  if(spins || slept)
+    lockwaited(&lk->lk, slept);
   release(&lk->lk);
 }
 
@@ -36,6 +85,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
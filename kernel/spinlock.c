@@ -7,13 +7,98 @@
 #include "riscv.h"
 #include "proc.h"
 #include "defs.h"
+#include "lockstat.h"
+
+// A waiting CPU reads lk->owner, then pauses before reading it
+// again, so that the waiters don't keep the cache line that the
+// holder must write to release the lock. The pause starts out
+// in proportion to how many tickets are ahead of ours, and
+// doubles, up to MAXBACKOFF, each time the owner hasn't moved.
+// The next waiter in line doesn't double: it would otherwise
+// still be pausing long after a long-held lock was handed to
+// it, with every waiter behind it waiting too.
+#define BACKOFF    16    // pause per ticket ahead, in loop iterations
+#define MAXBACKOFF 4096
+
+// Lock statistics, kept per lock name rather than per lock,
+// since many locks live in objects that come and go, like
+// pipes and inodes. Each CPU counts in its own lockcount, so
+// counting needs no atomic instructions or shared cache lines.
+struct lockcount {
+  uint64 nacquire;
+  uint64 ncontend;
+  uint64 nspin;
+  uint64 maxhold;
+  uint64 nsleep;
+  uint64 nspinwait;
+};
+
+struct lockclass {
+  char *name;
+  struct lockcount count[NCPU];
+} lockclass[NLOCKSTAT];
+
+int nlockclass;
+uint classlock;  // can't be a spinlock, which would need a class.
+
+// classes of recently seen name strings, hashed by address, so
+// that initlock() for each new pipe, buffer or inode finds its
+// class without classlock or comparing strings.
+#define NCLASSHASH 64
+struct lockclass *classhash[NCLASSHASH];
+
+// Find or make the class for locks called name.
+// Returns 0 if there are already NLOCKSTAT classes.
+static struct lockclass*
+lockclassof(char *name)
+{
+  struct lockclass *lc, **h;
+
+  h = &classhash[((uint64)name >> 3) % NCLASSHASH];
+  lc = __atomic_load_n(h, __ATOMIC_ACQUIRE);
+  if(lc && lc->name == name)
+    return lc;
+
+  // keep interrupts off while holding classlock, as acquire()
+  // does: a holder switched out by a timer interrupt would
+  // leave another initlock() on its CPU spinning forever.
+  push_off();
+  while(__sync_lock_test_and_set(&classlock, 1) != 0)
+    ;
+  __sync_synchronize();
+  for(lc = lockclass; lc < &lockclass[nlockclass]; lc++){
+    if(lc->name == name || strncmp(lc->name, name, LOCKNAME) == 0)
+      goto out;
+  }
+  lc = 0;
+  if(nlockclass < NLOCKSTAT){
+    lc = &lockclass[nlockclass++];
+    lc->name = name;
+  }
+ out:
+  if(lc)
+    __atomic_store_n(h, lc, __ATOMIC_RELEASE);
+  __sync_synchronize();
+  __sync_lock_release(&classlock);
+  pop_off();
+  return lc;
+}
 
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->class = lockclassof(name);
+}
+
+static void
+pause(uint n)
+{
+  for(volatile uint i = 0; i < n; i++)
+    ;
 }
 
 // Acquire the lock.
@@ -21,16 +106,30 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket, owner, last, delay, spins;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
   //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  //   s1 = &lk->next
+  //   amoadd.w.aqrl a5, a5, (s1)
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  last = ticket;
+  delay = 0;
+  spins = 0;
+  while((owner = *(volatile uint*)&lk->owner) != ticket){
+    spins++;
+    if(owner != last){
+      last = owner;
+      delay = (ticket - owner) * BACKOFF;
+    } else if(delay < MAXBACKOFF && ticket - owner > 1){
+      delay *= 2;
+    }
+    pause(delay < MAXBACKOFF ? delay : MAXBACKOFF);
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +139,44 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+
+  if(lk->class){
+    struct lockcount *c = &lk->class->count[cpuid()];
+    c->nacquire++;
+    if(spins){
+      c->ncontend++;
+      c->nspin += spins;
+    }
+    lk->tacquire = r_time();
+  }
+}
+
+// Acquire the lock if it is free, without spinning.
+// Returns 1 if it was acquired, 0 if another CPU holds it.
+int
+tryacquire(struct spinlock *lk)
+{
+  uint ticket;
+
+  push_off();
+  if(holding(lk))
+    panic("tryacquire");
+
+  // take the next ticket only if it is the owner's, i.e. the
+  // lock is free.
+  ticket = *(volatile uint*)&lk->owner;
+  if(*(volatile uint*)&lk->next != ticket ||
+     !__sync_bool_compare_and_swap(&lk->next, ticket, ticket + 1)){
+    pop_off();
+    return 0;
+  }
+  __sync_synchronize();
+  lk->cpu = mycpu();
+  if(lk->class){
+    lk->class->count[cpuid()].nacquire++;
+    lk->tacquire = r_time();
+  }
+  return 1;
 }
 
 // Release the lock.
@@ -49,6 +186,13 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  if(lk->class){
+    struct lockcount *c = &lk->class->count[cpuid()];
+    uint64 held = r_time() - lk->tacquire;
+    if(held > c->maxhold)
+      c->maxhold = held;
+  }
+
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +203,14 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Release the lock to the next ticket, equivalent to
+  // lk->owner++. This code doesn't use a C assignment, since
+  // the C standard implies that an assignment might be
+  // implemented with multiple store instructions.
+  // On RISC-V, sync_fetch_and_add turns into an atomic add:
+  //   s1 = &lk->owner
+  //   amoadd.w zero, a5, (s1)
+  __sync_fetch_and_add(&lk->owner, 1);
 
   pop_off();
 }
@@ -77,7 +221,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->next != lk->owner && lk->cpu == mycpu());
   return r;
 }
 
@@ -108,3 +252,52 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// For acquiresleep(): the sleep lock whose spinlock is lk was
+// held, and acquiresleep() had to sleep, or, if slept is 0,
+// got it by spinning alone.
+// Caller holds lk.
+void
+lockwaited(struct spinlock *lk, int slept)
+{
+  struct lockcount *c;
+
+  if(lk->class == 0)
+    return;
+  c = &lk->class->count[cpuid()];
+  if(slept)
+    c->nsleep++;
+  else
+    c->nspinwait++;
+}
+
+// Copy the statistics of up to n lock names, summed over the
+// CPUs, to user address addr, an array of struct lockstat.
+// Returns how many were copied, or -1.
+int
+lockstat(uint64 addr, int n)
+{
+  struct lockstat st;
+  struct lockclass *lc;
+  struct lockcount *c;
+  int i, nclass;
+
+  nclass = *(volatile int*)&nlockclass;
+  for(i = 0; i < n && i < nclass; i++){
+    lc = &lockclass[i];
+    memset(&st, 0, sizeof(st));
+    safestrcpy(st.name, lc->name, sizeof(st.name));
+    for(c = lc->count; c < &lc->count[NCPU]; c++){
+      st.nacquire += c->nacquire;
+      st.ncontend += c->ncontend;
+      st.nspin += c->nspin;
+      if(c->maxhold > st.maxhold)
+        st.maxhold = c->maxhold;
+      st.nsleep += c->nsleep;
+      st.nspinwait += c->nspinwait;
+    }
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  return i;
+}
@@ -1,9 +1,16 @@
 // Mutual exclusion lock.
+// A ticket lock: each acquire() takes the next ticket and
+// waits for owner to reach it, so CPUs get the lock in the
+// order they asked for it.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint next;         // Next ticket to hand out.
+  uint owner;        // Ticket that holds the lock; free if == next.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
-};
 
+  // For lockstat():
+  struct lockclass *class;  // Counters for locks of this name, or 0.
+  uint64 tacquire;          // When the holder acquired it.
+};
@@ -6,10 +6,16 @@
 
 void main();
 void timerinit();
+void ipiinit();
+extern void ipivec();
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// a scratch area per CPU for ipivec in kernelvec.S:
+// [0] saves a1, [1] is the address of the CPU's MSIP register.
+uint64 ipi_scratch[NCPU][2];
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -40,6 +46,9 @@ start()
   // ask for clock interrupts.
   timerinit();
 
+  // let other harts interrupt this one.
+  ipiinit();
+
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
   w_tp(id);
@@ -64,3 +73,17 @@ timerinit()
   // ask for the very first timer interrupt.
   w_stimecmp(r_time() + 1000000);
 }
+
+// other harts interrupt this one by writing its CLINT MSIP
+// register; ipivec turns the machine-mode software interrupt
+// that raises into a supervisor-mode one, for devintr().
+void
+ipiinit()
+{
+  int id = r_mhartid();
+
+  ipi_scratch[id][1] = CLINT_MSIP(id);
+  w_mscratch((uint64)ipi_scratch[id]);
+  w_mtvec((uint64)ipivec);
+  w_mie(r_mie() | MIE_MSIE);
+}
@@ -20,3 +20,15 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_memstat 22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_schedstat 25
+#define SYS_nice   26
+#define SYS_setpriority 27
+#define SYS_nanosleep 28
+#define SYS_clone  29
+#define SYS_join   30
+#define SYS_futex_wait 31
+#define SYS_futex_wake 32
+#define SYS_lockstat 33
@@ -25,7 +25,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE || (f=myproc()->tg->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -40,17 +40,38 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct tgroup *tg = myproc()->tg;
 
+  acquire(&tg->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(tg->ofile[fd] == 0){
+      tg->ofile[fd] = f;
+      release(&tg->lock);
       return fd;
     }
   }
+  release(&tg->lock);
   return -1;
 }
 
+// Take fd out of the current process's file table, if it
+// still refers to f; another thread may have closed it.
+// Returns 0, or -1 if it doesn't.
+static int
+fdfree(int fd, struct file *f)
+{
+  struct tgroup *tg = myproc()->tg;
+  int r = -1;
+
+  acquire(&tg->lock);
+  if(tg->ofile[fd] == f){
+    tg->ofile[fd] = 0;
+    r = 0;
+  }
+  release(&tg->lock);
+  return r;
+}
+
 uint64
 sys_dup(void)
 {
@@ -59,9 +80,11 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
-    return -1;
   filedup(f);
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -76,6 +99,8 @@ sys_read(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0)
+    vmaprefault(p, n);
   return fileread(f, p, n);
 }
 
@@ -90,6 +115,8 @@ sys_write(void)
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
+  if(n > 0)
+    vmaprefault(p, n);
 
   return filewrite(f, p, n);
 }
@@ -100,9 +127,8 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argfd(0, &fd, &f) < 0 || fdfree(fd, f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -410,7 +436,7 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
+  struct inode *ip, *old;
   struct proc *p = myproc();
   
   begin_op();
@@ -425,9 +451,12 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&p->tg->lock);
+  old = p->tg->cwd;
+  p->tg->cwd = ip;
+  release(&p->tg->lock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
@@ -487,19 +516,56 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    if(fd0 < 0 || fdfree(fd0, rf) == 0)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    // unless another thread has closed them already.
+    if(fdfree(fd0, rf) == 0)
+      fileclose(rf);
+    if(fdfree(fd1, wf) == 0)
+      fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+// map a file into memory.
+// mmap(addr, length, prot, flags, fd, offset); addr must be 0.
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len;
+  int prot, flags, off;
+  struct file *f;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  if(addr != 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable || (prot & PROT_READ) == 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  return mmap(f->ip, len, prot, flags, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
@@ -5,6 +5,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
+#include "schedstat.h"
 
 uint64
 sys_exit(void)
@@ -32,42 +34,82 @@ sys_wait(void)
 {
   uint64 p;
   argaddr(0, &p);
+  if(p != 0)
+    vmaprefault(p, sizeof(int));
   return wait(p);
 }
 
 uint64
-sys_sbrk(void)
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  uint64 p;
+  argaddr(0, &p);
+  if(p != 0)
+    vmaprefault(p, sizeof(uint64));
+  return join(p);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futexwait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
 {
   uint64 addr;
   int n;
 
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futexwake(addr, n);
+}
+
+uint64
+sys_sbrk(void)
+{
+  int n;
+
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return timersleep(r_time() + (uint64)n * TICKTIME);
+}
+
+// sleep for at least the given number of nanoseconds.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  argaddr(0, &ns);
+  return timersleep(r_time() + ns / (1000000000L / TIMEFREQ));
 }
 
 uint64
@@ -91,3 +133,76 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// copy the physical memory allocator's statistics
+// to the user's struct memstat.
+uint64
+sys_memstat(void)
+{
+  uint64 addr;
+  struct memstat st;
+
+  argaddr(0, &addr);
+  kmemstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// copy every CPU's scheduler statistics to the user's
+// array of NCPU struct schedstats.
+uint64
+sys_schedstat(void)
+{
+  uint64 addr;
+  struct schedstat st[NCPU];
+
+  argaddr(0, &addr);
+  schedstat(st);
+  if(copyout(myproc()->pagetable, addr, (char*)st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// copy the statistics of up to n lock names to the user's
+// array of struct lockstats; return how many there were.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return lockstat(addr, n);
+}
+
+// add inc to this process's nice value, keeping it within
+// the scheduler's priority levels; return the new value.
+uint64
+sys_nice(void)
+{
+  int inc, n;
+  struct proc *p = myproc();
+
+  argint(0, &inc);
+  acquire(&p->lock);
+  n = p->nice + inc;
+  if(n < 0)
+    n = 0;
+  if(n > NPRIO-1)
+    n = NPRIO-1;
+  p->nice = n;
+  release(&p->lock);
+  return n;
+}
+
+uint64
+sys_setpriority(void)
+{
+  int pid, nice;
+
+  argint(0, &pid);
+  argint(1, &nice);
+  return setpriority(pid, nice);
+}
@@ -0,0 +1,227 @@
+// Timers for sleeping processes, with deadlines finer
+// than a clock tick.
+//
+// Each CPU keeps a hierarchical timer wheel of the timers
+// started on it. Time on a wheel is counted in slots of
+// TIMERRES timer cycles. Level 0 has one list per slot for
+// the next NSLOT slots; each list at level l covers NSLOT^l
+// slots, and its timers "cascade" down to lower levels when
+// the wheel's clock reaches them. Adding or cancelling a
+// timer is O(1), and each timer cascades at most NLEVEL-1
+// times before it fires.
+//
+// Each CPU runs its wheel from its timer interrupt and asks
+// for the next interrupt no later than its earliest timer,
+// so that a short sleep doesn't have to wait for a tick.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define TIMERRES 1000  // timer cycles per wheel slot (100 us)
+#define WBITS    6
+#define NSLOT    (1 << WBITS)
+#define NLEVEL   4
+#define SHIFT(l) (WBITS*(l))
+#define MAXSLOTS (1UL << SHIFT(NLEVEL))  // furthest a timer can be placed
+
+struct timer {
+  uint64 expires;       // slot it is due in
+  int level;            // wheel level it is on
+  int fired;
+  struct timer *next;
+  struct timer **pprev; // link that points to this timer
+};
+
+struct wheel {
+  struct spinlock lock;
+  uint64 clk;           // next slot to run
+  int n[NLEVEL];        // number of timers on each level
+  struct timer *slot[NLEVEL][NSLOT];
+} wheels[NCPU];
+
+void
+wheelinit(void)
+{
+  uint64 now = r_time() / TIMERRES;
+
+  for(int i = 0; i < NCPU; i++){
+    initlock(&wheels[i].lock, "wheel");
+    wheels[i].clk = now;
+  }
+}
+
+// Put t on the list of the slot it expires in, at the
+// lowest level whose lists reach that far.
+// Caller holds w->lock.
+static void
+place(struct wheel *w, struct timer *t)
+{
+  uint64 e = t->expires;
+  struct timer **head;
+  int l;
+
+  if(e < w->clk)
+    e = w->clk;
+  if(e - w->clk >= MAXSLOTS)
+    e = w->clk + MAXSLOTS - 1;  // cascades again when it gets there.
+  for(l = 0; l < NLEVEL-1 && e - w->clk >= (1UL << SHIFT(l+1)); l++)
+    ;
+  head = &w->slot[l][(e >> SHIFT(l)) & (NSLOT-1)];
+  t->level = l;
+  t->next = *head;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  w->n[l]++;
+}
+
+// Caller holds w->lock.
+static void
+unlink(struct wheel *w, struct timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  w->n[t->level]--;
+}
+
+// Move the timers on level l's slot s down to lower levels.
+// Caller holds w->lock.
+static void
+cascade(struct wheel *w, int l, int s)
+{
+  struct timer *t, *next;
+
+  t = w->slot[l][s];
+  w->slot[l][s] = 0;
+  for(; t; t = next){
+    next = t->next;
+    w->n[l]--;
+    place(w, t);
+  }
+}
+
+// Fire every timer on w that is due by slot now,
+// waking the processes sleeping on them.
+// Caller holds w->lock.
+static void
+advance(struct wheel *w, uint64 now)
+{
+  struct timer *t;
+  uint64 span;
+  int l, idx;
+
+  while(w->clk <= now){
+    idx = w->clk & (NSLOT-1);
+    if(idx == 0){
+      for(l = 1; l < NLEVEL; l++){
+        int s = (w->clk >> SHIFT(l)) & (NSLOT-1);
+        cascade(w, l, s);
+        if(s != 0)
+          break;
+      }
+    }
+    while((t = w->slot[0][idx]) != 0){
+      unlink(w, t);
+      t->fired = 1;
+      wakeup(t);
+    }
+    w->clk++;
+
+    // with the lower levels empty, nothing happens
+    // until the next cascade from the lowest busy one.
+    for(l = 0; l < NLEVEL && w->n[l] == 0; l++)
+      ;
+    if(l == NLEVEL){
+      w->clk = now + 1;
+    } else if(l > 0){
+      span = 1UL << SHIFT(l);
+      uint64 next = (w->clk + span - 1) & ~(span - 1);
+      w->clk = next < now + 1 ? next : now + 1;
+    }
+  }
+}
+
+// The time, in timer cycles, at which w next has work to
+// do: a timer to fire or a list to cascade. ~0 if none.
+// Caller holds w->lock.
+static uint64
+nextevent(struct wheel *w)
+{
+  uint64 best = ~0UL;
+
+  for(int l = 0; l < NLEVEL; l++){
+    if(w->n[l] == 0)
+      continue;
+    uint64 base = w->clk >> SHIFT(l);
+    for(uint64 j = 0; j <= NSLOT; j++){
+      uint64 when = (base + j) << SHIFT(l);
+      if(when < w->clk)
+        continue;
+      if(w->slot[l][(base + j) & (NSLOT-1)]){
+        if(when < best)
+          best = when;
+        break;
+      }
+    }
+  }
+  return best == ~0UL ? best : best * TIMERRES;
+}
+
+// Called from each CPU's timer interrupt: fire this CPU's
+// due timers, and return when the next one is due.
+uint64
+timerrun(void)
+{
+  struct wheel *w = &wheels[cpuid()];
+  uint64 next;
+
+  acquire(&w->lock);
+  advance(w, r_time() / TIMERRES);
+  next = nextevent(w);
+  release(&w->lock);
+  return next;
+}
+
+// Sleep until the timer reaches when.
+// Returns -1 if the process was killed first.
+int
+timersleep(uint64 when)
+{
+  struct proc *p = myproc();
+  struct wheel *w;
+  struct timer t;
+
+  if(when <= r_time())
+    return 0;
+
+  // holding w->lock keeps us on this CPU, so that it is
+  // this CPU's timer interrupt that must come early.
+  push_off();
+  w = &wheels[cpuid()];
+  acquire(&w->lock);
+  pop_off();
+
+  t.expires = (when + TIMERRES - 1) / TIMERRES;
+  t.fired = 0;
+  place(w, &t);
+  if(t.expires * TIMERRES < r_stimecmp())
+    w_stimecmp(t.expires * TIMERRES);
+
+  while(!t.fired){
+    if(killed(p)){
+      unlink(w, &t);
+      release(&w->lock);
+      return -1;
+    }
+    sleep(&t, &w->lock);
+  }
+  release(&w->lock);
+  return 0;
+}
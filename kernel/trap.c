@@ -45,6 +45,9 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  mycpu()->inuser = 0;
+  mycpu()->ntrap++;
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -65,6 +68,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15 ? 0 : r_scause() == 12 ? 2 : 1) != 0){
+    // page fault on a demand-paged, lazily-allocated,
+    // or copy-on-write page.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,8 +83,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this is a timer interrupt
+  // and the time slice is up.
+  if(which_dev == 2 && timeslice())
     yield();
 
   usertrapret();
@@ -122,11 +130,16 @@ usertrapret(void)
   // tell trampoline.S the user page table to switch to.
   uint64 satp = MAKE_SATP(p->pagetable);
 
+  // from here on, tlbshootdown() must interrupt this CPU.
+  mycpu()->inuser = 1;
+  __sync_synchronize();
+
   // jump to userret in trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // switches to the user page table, restores user registers
+  // from this thread's trapframe, and switches to user mode
+  // with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->tfva);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -150,8 +163,9 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0)
+  // give up the CPU if this is a timer interrupt
+  // and the time slice is up.
+  if(which_dev == 2 && myproc() != 0 && timeslice())
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -160,26 +174,52 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
-void
+// returns 1 if this CPU's clock ticked, and 0 if
+// the interrupt was only for a timer in timer.c.
+int
 clockintr()
 {
-  if(cpuid() == 0){
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+  uint64 next;
+  int tick = 0;
+
+  if(now >= c->nexttick){
+    // every CPU ticks on the same TICKTIME boundaries,
+    // and ticks counts them whichever CPUs are busy.
+    tick = 1;
+    c->nexttick = (now / TICKTIME + 1) * TICKTIME;
     acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
+    if(now / TICKTIME > ticks)
+      ticks = now / TICKTIME;
     release(&tickslock);
+
+    // even out the run queues, and stop low priority
+    // processes from starving.
+    rebalance();
+    boost();
   }
 
-  // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  // ask for the next timer interrupt, at the next tick
+  // or the next timer, whichever is sooner. this also
+  // clears the interrupt request.
+  next = timerrun();
+  w_stimecmp(next < c->nexttick ? next : c->nexttick);
+  return tick;
+}
+
+// interrupt CPU id, e.g. to have it stop idling and look
+// at the run queues.
+void
+ipi(int id)
+{
+  *(volatile uint32*)CLINT_MSIP(id) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
-// 1 if other device,
+// returns 2 if timer interrupt that ticked the clock,
+// 1 if other device or timer,
 // 0 if not recognized.
 int
 devintr()
@@ -206,11 +246,17 @@ devintr()
     if(irq)
       plic_complete(irq);
 
+    return 1;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt from another CPU's ipi(), to get
+    // this CPU out of wfi to look at the run queues.
+    w_sip(r_sip() & ~2);
     return 1;
   } else if(scause == 0x8000000000000005L){
     // timer interrupt.
-    clockintr();
-    return 2;
+    if(clockintr())
+      return 2;
+    return 1;
   } else {
     return 0;
   }
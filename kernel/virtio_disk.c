@@ -48,6 +48,7 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char async;    // started by virtio_disk_read_async()?
   } info[NUM];
 
   // disk command headers.
@@ -212,26 +213,18 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Format a request for b in the three descriptors in idx,
+// and hand it to the device.
+// Caller holds disk.vdisk_lock.
+static void
+submit(struct buf *b, int write, int *idx, int async)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
-  acquire(&disk.vdisk_lock);
-
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
   // data, one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
   // format the three descriptors.
   // qemu's virtio-blk.c reads them.
 
@@ -267,6 +260,7 @@ virtio_disk_rw(struct buf *b, int write)
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
   disk.info[idx[0]].b = b;
+  disk.info[idx[0]].async = async;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -279,6 +273,24 @@ virtio_disk_rw(struct buf *b, int write)
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  int idx[3];
+
+  acquire(&disk.vdisk_lock);
+
+  // allocate the three descriptors.
+  while(1){
+    if(alloc3_desc(idx) == 0) {
+      break;
+    }
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  }
+
+  submit(b, write, idx, 0);
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
@@ -291,9 +303,33 @@ virtio_disk_rw(struct buf *b, int write)
   release(&disk.vdisk_lock);
 }
 
+// Start reading b without waiting for it: virtio_disk_intr()
+// calls bdone(b) when the data is there. For read-ahead, so
+// rather than wait for descriptors, or take the last ones a
+// virtio_disk_rw() could use, it returns -1 and doesn't start.
+int
+virtio_disk_read_async(struct buf *b)
+{
+  int idx[3], nfree = 0;
+
+  acquire(&disk.vdisk_lock);
+  for(int i = 0; i < NUM; i++)
+    nfree += disk.free[i];
+  if(nfree < 2*3 || alloc3_desc(idx) < 0){
+    release(&disk.vdisk_lock);
+    return -1;
+  }
+  submit(b, 0, idx, 1);
+  release(&disk.vdisk_lock);
+  return 0;
+}
+
 void
 virtio_disk_intr()
 {
+  struct buf *done[NUM];
+  int ndone = 0;
+
   acquire(&disk.vdisk_lock);
 
   // the device won't raise another interrupt until we tell it
@@ -318,10 +354,22 @@ virtio_disk_intr()
 
     struct buf *b = disk.info[id].b;
     b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    if(disk.info[id].async){
+      // no virtio_disk_rw() is waiting to free the chain.
+      disk.info[id].b = 0;
+      free_chain(id);
+      done[ndone++] = b;
+    } else {
+      wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
 
   release(&disk.vdisk_lock);
+
+  // bdone() takes buffer cache locks, which mustn't be
+  // acquired with vdisk_lock held.
+  for(int i = 0; i < ndone; i++)
+    bdone(done[i]);
 }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -30,6 +32,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT software interrupt registers, for ipi().
+  kvmmap(kpgtbl, CLINT, CLINT, PGSIZE, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
@@ -37,6 +42,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // mappages() uses 2 MB megapages for the aligned parts.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -82,6 +88,10 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE can also be a leaf that maps a whole 2 MB
+// megapage, marked with PTE_MEGA. If va lies in a megapage,
+// walk() returns that level-1 PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -91,17 +101,85 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;  // a megapage.
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the level-1 PTE for va, which
+// either points to a level-0 page-table page or maps a
+// megapage. If alloc!=0, create the level-1 page-table
+// page if needed.
+static pte_t *
+walkmega(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// walk(pagetable, va, 0) found no page-table page for va.
+// Return the next address that might be mapped: the start of
+// the next 1 GB if there's no level-1 page-table page either,
+// else of the next 2 MB. A lazily grown heap can span many
+// such holes, and stepping over them a page at a time would
+// make fork() and exit() slow.
+static uint64
+nexttable(pagetable_t pagetable, uint64 va)
+{
+  uint64 size = MEGASIZE;
+
+  if((pagetable[PX(2, va)] & PTE_V) == 0)
+    size = 1L << PXSHIFT(2);
+  return (va & ~(size - 1)) + size;
+}
+
+// Return the physical address of the 4096-byte page
+// containing va, given the leaf PTE that walk() found.
+static uint64
+leafpa(pte_t pte, uint64 va)
+{
+  if(pte & PTE_MEGA)
+    return PTE2PA(pte) + (PGROUNDDOWN(va) & (MEGASIZE-1));
+  return PTE2PA(pte);
+}
+
+// Replace the megapage mapped by level-1 PTE *pte with a
+// level-0 page-table page that maps the same memory with
+// 4096-byte pages. Each page of a megapage has its own
+// reference count, so the pages can be freed one by one.
+// Returns 0 on success, -1 if out of memory.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pagetable;
+  uint64 pa;
+  uint flags;
+
+  if((pagetable = (pagetable_t)kalloc_zeroed()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -121,7 +199,7 @@ walkaddr(pagetable_t pagetable, uint64 va)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = leafpa(*pte, va);
   return pa;
 }
 
@@ -137,7 +215,9 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa.
-// va and size MUST be page-aligned.
+// va and size MUST be page-aligned. Wherever va and pa are
+// both 2 MB-aligned and at least 2 MB remain, a single
+// megapage PTE maps the next 2 MB.
 // Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
@@ -158,6 +238,18 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = va;
   last = va + size - PGSIZE;
   for(;;){
+    if(a % MEGASIZE == 0 && pa % MEGASIZE == 0 && last - a >= MEGASIZE - PGSIZE){
+      if((pte = walkmega(pagetable, a, 1)) == 0)
+        return -1;
+      if(*pte & PTE_V)
+        panic("mappages: remap");
+      *pte = PA2PTE(pa) | perm | PTE_MEGA | PTE_V;
+      if(a + MEGASIZE - PGSIZE == last)
+        break;
+      a += MEGASIZE;
+      pa += MEGASIZE;
+      continue;
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -171,25 +263,73 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+#define UNMAP_DETACH 2  // uvmunmap(): leave the page in the cleared PTE
+
+// If va, which must be page-aligned, falls inside a megapage
+// rather than at its start, split the megapage into 4096-byte
+// pages, so that the memory below va can stay mapped when the
+// rest is unmapped. Returns 0, or -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va % MEGASIZE == 0 || va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_MEGA) == 0)
+    return 0;
+  return demote(pte);
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
-uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+// page-aligned. Pages that were never faulted in are
+// skipped. Optionally free the physical memory; or, with
+// do_free == UNMAP_DETACH, clear only PTE_V and leave each
+// page's address in its PTE, for uvmreap() to free later.
+// A megapage that is only partly unmapped is split into
+// 4096-byte pages; a caller that can't fail there must
+// uvmsplit() at va first.
+static void
+unmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end;
   pte_t *pte;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0){
+      a = nexttable(pagetable, a) - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
+    if(*pte & PTE_MEGA){
+      if(a % MEGASIZE == 0 && a + MEGASIZE <= end){
+        if(do_free == UNMAP_DETACH){
+          *pte &= ~PTE_V;
+          a += MEGASIZE - PGSIZE;
+          continue;
+        }
+        if(do_free)
+          kfree_order((void*)PTE2PA(*pte), MEGAORDER);
+        *pte = 0;
+        a += MEGASIZE - PGSIZE;
+        continue;
+      }
+      if(demote(pte) < 0)
+        panic("uvmunmap: split");
+      pte = walk(pagetable, a, 0);
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(do_free == UNMAP_DETACH){
+      *pte &= ~PTE_V;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -198,16 +338,62 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  unmap(pagetable, va, npages, do_free);
+}
+
+// Unmap npages starting at va like uvmunmap(), but don't free
+// the pages yet: other CPUs may still have them in their TLBs.
+// Once those are flushed, uvmreap() frees them. Nothing may
+// map the range in between.
+void
+uvmdetach(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  unmap(pagetable, va, npages, UNMAP_DETACH);
+}
+
+// Free the pages that uvmdetach() left in the PTEs of the
+// npages starting at va.
+void
+uvmreap(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 a, end;
+  pte_t *pte;
+
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = walkmega(pagetable, a, 0)) == 0 || *pte == 0){
+      a = nexttable(pagetable, a) - PGSIZE;  // nothing here.
+      continue;
+    }
+    if((*pte & PTE_V) == 0){
+      // a detached megapage.
+      kfree_order((void*)PTE2PA(*pte), MEGAORDER);
+      *pte = 0;
+      a = MEGAROUNDDOWN(a) + MEGASIZE - PGSIZE;
+      continue;
+    }
+    if(*pte & (PTE_R|PTE_W|PTE_X))
+      continue;  // a megapage still in use.
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, a)];
+    if(*pte != 0 && (*pte & PTE_V) == 0){
+      kfree((void*)PTE2PA(*pte));
+      *pte = 0;
+    }
+  }
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -221,8 +407,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -240,12 +425,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -303,42 +487,257 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, make the child's
+// page table share the parent's memory in [start, end).
+// Writable pages become read-only and copy-on-write in both
+// page tables; vmfault() gives a process its own copy of
+// such a page the first time it writes to it. If share is
+// set, as for a MAP_SHARED mapping, writable pages stay
+// writable and both processes keep using the same page.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0){
+      // never touched; the child will fault it in.
+      i = nexttable(old, i) - PGSIZE;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(*pte & PTE_MEGA){
+      // copy a megapage now, rather than share its 512
+      // pages copy-on-write. if there is no megapage free
+      // for the copy, split the parent's into small pages.
+      if((mem = kalloc_order(MEGAORDER)) != 0){
+        memmove(mem, (char*)PTE2PA(*pte), MEGASIZE);
+        flags = PTE_FLAGS(*pte) & ~PTE_MEGA;
+        if(mappages(new, i, MEGASIZE, (uint64)mem, flags) != 0){
+          kfree_order(mem, MEGAORDER);
+          goto err;
+        }
+        i += MEGASIZE - PGSIZE;
+        continue;
+      }
+      if(demote(pte) < 0)
+        goto err;
+      pte = walk(old, i, 0);
+    }
+    if((*pte & PTE_W) && !share)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Give the copy-on-write page that pte refers to a private,
+// writable copy, or just make it writable if no one else
+// refers to the page any more.
+// Returns the page's new physical address, or 0 if out of
+// memory. If it copied, *old is the page it copied, which the
+// caller must kfree() once no TLB can refer to it any more.
+static uint64
+cowcopy(pte_t *pte, uint64 *old)
+{
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  *old = 0;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt((void*)pa) == 1){
+    // the last sharer; no need to copy.
+    *pte = PA2PTE(pa) | flags;
+    return pa;
+  }
+  if((mem = kalloc()) == 0)
+    return 0;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  *old = pa;
+  return (uint64)mem;
+}
+
+// Try to back the whole 2 MB-aligned region around va with
+// one zeroed megapage. This only happens if all of the region
+// is heap that the process hasn't touched yet, e.g. after
+// a large sbrk(), and the heap is at least MEGAHEAP bytes;
+// smaller processes would mostly waste the memory.
+// Returns the physical address of the megapage, or 0.
+// Caller holds p->tg->lock.
+static uint64
+megafault(struct proc *p, uint64 va)
+{
+  uint64 a = MEGAROUNDDOWN(va);
+  pagetable_t pt;
+  pte_t *pte;
+  char *mem;
+  int i;
+
+  if(p->tg->sz < MEGAHEAP || a + MEGASIZE > p->tg->sz ||
+     vmaoverlap(p, a, a + MEGASIZE))
+    return 0;
+  if((pte = walkmega(p->pagetable, a, 0)) != 0 && (*pte & PTE_V)){
+    // a page-table page left empty by an earlier sbrk(-n)
+    // can go; one that still maps something can't.
+    pt = (pagetable_t)PTE2PA(*pte);
+    for(i = 0; i < 512; i++)
+      if(pt[i] & PTE_V)
+        return 0;
+    *pte = 0;
+    kfree(pt);
+  }
+  if((mem = kalloc_order(MEGAORDER)) == 0)
+    return 0;
+  memset(mem, 0, MEGASIZE);
+  if(mappages(p->pagetable, a, MEGASIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree_order(mem, MEGAORDER);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Handle a page fault at user virtual address va in
+// pagetable. read is 1 for a load, 2 for an instruction
+// fetch, 0 for a store.
+//  - a page of the program that exec() hasn't loaded yet,
+//    or of an mmap()ed file, is read from the file.
+//  - a heap page that sbrk() reserved but the process
+//    hasn't touched yet gets a freshly zeroed page, or a
+//    whole zeroed megapage if it can.
+//  - a store to a copy-on-write page gets a private copy.
+// The process's other threads may fault on the same page
+// at the same time; the page table changes under p->tg->lock,
+// which isn't held while reading from a file.
+// Returns the physical address of the page, or 0 if the
+// access is not allowed or memory ran out.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int read)
+{
+  struct proc *p = myproc();
+  struct tgroup *tg = 0;
+  struct vma *v, file;
+  pte_t *pte;
+  uint64 pa = 0, old;
+  char *mem;
+  int perm, cansleep;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+
+  // reading a file may sleep, which copyin() and copyout()
+  // must not do while holding a spinlock. interrupts are
+  // always off when a spinlock is held.
+  cansleep = intr_get() || mycpu()->noff == 0;
+
+  if(p && pagetable == p->pagetable){
+    tg = p->tg;
+    acquire(&tg->lock);
+    if(va >= tg->unmapstart && va < tg->unmapend)
+      goto out;
+  }
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if((*pte & PTE_U) == 0)
+      goto out;
+    if(*pte & (read == 2 ? PTE_X : read ? PTE_R : PTE_W)){
+      // another thread faulted the page in, or broke its
+      // copy-on-write, first.
+      pa = leafpa(*pte, va);
+    } else if(!read && (*pte & PTE_COW) != 0){
+      pa = cowcopy(pte, &old);
+      if(old){
+        // other threads may still read the old page.
+        if(tg && tg->ref > 1)
+          tlbshootdown(tg);
+        kfree((void*)old);
+      }
+    }
+    goto out;
+  }
+
+  // not mapped. part of the program or an mmap()ed file,
+  // or of the lazily-allocated heap?
+  if(tg == 0)
+    return 0;
+  if((v = vmalookup(p, va)) == 0 && va >= tg->sz)
+    goto out;
+  perm = PTE_R|PTE_W|PTE_U;
+  if(v){
+    perm = v->perm;
+    if((!read && (perm & PTE_W) == 0) || !cansleep)
+      goto out;
+    // munmap() waits for nfault to drop to zero before
+    // it lets go of the file.
+    file = *v;
+    tg->nfault++;
+    release(&tg->lock);
+    mem = vmapage(&file, va);
+    acquire(&tg->lock);
+    if(--tg->nfault == 0)
+      wakeup(&tg->nfault);
+    if(mem && (vmalookup(p, va) == 0 || (va >= tg->unmapstart && va < tg->unmapend))){
+      // sbrk() cut the region short meanwhile, or munmap()
+      // is taking it away.
+      kfree(mem);
+      goto out;
+    }
+  } else if((pa = megafault(p, va)) != 0){
+    pa += va & (MEGASIZE-1);
+    goto out;
+  } else {
+    mem = kalloc_zeroed();
+  }
+  if(mem == 0)
+    goto out;
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // another thread faulted it in meanwhile.
+    kfree(mem);
+    pa = leafpa(*pte, va);
+  } else if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+  } else {
+    pa = (uint64)mem;
+  }
+
+ out:
+  if(tg)
+    release(&tg->lock);
+  return pa;
+}
+
+// Make the pages mapped in the npages starting at va read-only.
+// The caller must flush the TLBs that may still allow stores.
+void
+uvmwprotect(pagetable_t pagetable, uint64 va, uint64 npages)
+{
+  uint64 a;
+  pte_t *pte;
+
+  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) != 0 && (*pte & PTE_V))
+      *pte &= ~PTE_W;
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -366,10 +765,14 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
     pte = walk(pagetable, va0, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
-       (*pte & PTE_W) == 0)
-      return -1;
-    pa0 = PTE2PA(*pte);
+    if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W)){
+      // not yet allocated, or copy-on-write?
+      if(vmfault(pagetable, va0, 0) == 0)
+        return -1;
+      pte = walk(pagetable, va0, 0);
+    }
+    *pte |= PTE_D;  // for munmap() of a MAP_SHARED page.
+    pa0 = leafpa(*pte, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -393,7 +796,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -420,7 +823,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
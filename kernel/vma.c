@@ -0,0 +1,565 @@
+//
+// Demand-paged memory regions.
+//
+// exec() doesn't read a program into memory. It records
+// each loadable segment as a struct vma in the process,
+// and vmfault() reads a page of the segment from the file
+// the first time the process touches it.
+//
+// mmap() adds regions of the same kind, placed downward
+// from MMAPTOP. A MAP_PRIVATE region's pages belong to the
+// process, and fork() shares them copy-on-write; a
+// MAP_SHARED region's pages are shared with children, and
+// the pages the process wrote are written back to the file
+// when the region is unmapped.
+//
+// Pages of read-only, executable segments are also kept in
+// a small cache keyed by (dev, inum, file offset), so that
+// every process running the same program maps the same
+// physical copy of its text. Writing or truncating the file
+// drops its pages from the cache, and a process that was
+// running the old program can't fault in any more pages of
+// it, rather than run a mix of old and new code. Pages that
+// only the cache refers to are given back when kalloc() runs
+// out of memory.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+
+#define NTEXT 256   // pages in the shared text cache
+
+struct textpage {
+  uint dev;
+  uint inum;
+  uint off;         // file offset of the page
+  uint n;           // bytes of the page that came from the file
+  char *pa;         // 0 if the slot is unused
+};
+
+struct {
+  struct spinlock lock;
+  struct textpage page[NTEXT];
+  int hand;         // next slot to reuse when all are full
+} textcache;
+
+void
+vmainit(void)
+{
+  initlock(&textcache.lock, "textcache");
+}
+
+// Look for a cached text page of ip.
+// Returns it with an added reference, or 0.
+static char*
+textget(struct inode *ip, uint off, uint n)
+{
+  struct textpage *t;
+  char *pa = 0;
+
+  acquire(&textcache.lock);
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum &&
+       t->off == off && t->n == n){
+      pa = kdup(t->pa);
+      break;
+    }
+  }
+  release(&textcache.lock);
+  return pa;
+}
+
+// Add the page pa, just read from ip, to the cache.
+// The caller holds ip's lock, so no one else can have
+// cached the same page meanwhile.
+static void
+textput(struct inode *ip, uint off, uint n, char *pa)
+{
+  struct textpage *t, *free = 0;
+
+  acquire(&textcache.lock);
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+    if(t->pa == 0){
+      free = t;
+      break;
+    }
+  }
+  if(free == 0){
+    // evict the next page in turn. processes that
+    // map it keep their own references.
+    free = &textcache.page[textcache.hand];
+    textcache.hand = (textcache.hand + 1) % NTEXT;
+    kfree(free->pa);
+  }
+  free->dev = ip->dev;
+  free->inum = ip->inum;
+  free->off = off;
+  free->n = n;
+  free->pa = kdup(pa);
+  release(&textcache.lock);
+  ip->text = 1;
+}
+
+// Forget ip's cached pages, if it has any. Called when its
+// contents change, and when its inode table entry is freed
+// or reused, after which nothing would forget them.
+// Caller must hold ip's lock, or itable.lock if ip->ref is 0.
+void
+textdrop(struct inode *ip)
+{
+  struct textpage *t;
+
+  if(ip->text == 0)
+    return;
+  ip->text = 0;
+  acquire(&textcache.lock);
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum){
+      kfree(t->pa);
+      t->pa = 0;
+    }
+  }
+  release(&textcache.lock);
+}
+
+// ip's contents are about to change, so forget its cached
+// pages. Processes already running the old program keep
+// the pages they have mapped, but vmapage() won't give them
+// any more.
+// Caller must hold ip's lock.
+void
+textinval(struct inode *ip)
+{
+  ip->gen++;
+  textdrop(ip);
+}
+
+// Give back the cached text pages that no process has mapped,
+// when kalloc() is out of memory. Returns how many it freed.
+int
+textshrink(void)
+{
+  struct textpage *t;
+  int n = 0;
+
+  acquire(&textcache.lock);
+  for(t = textcache.page; t < &textcache.page[NTEXT]; t++){
+    if(t->pa && krefcnt(t->pa) == 1){
+      kfree(t->pa);
+      t->pa = 0;
+      n++;
+    }
+  }
+  release(&textcache.lock);
+  return n;
+}
+
+// Return p's region that contains virtual address va, or 0.
+// Caller holds p->tg->lock.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->tg->vma; v < &p->tg->vma[NVMA]; v++){
+    if(v->ip && va >= v->start && va < v->end)
+      return v;
+  }
+  return 0;
+}
+
+// Does any of p's regions overlap [start, end)?
+// Caller holds p->tg->lock.
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->tg->vma; v < &p->tg->vma[NVMA]; v++){
+    if(v->ip && v->start < end && start < v->end)
+      return 1;
+  }
+  return 0;
+}
+
+// Return a page holding v's contents at va, which must be
+// page-aligned and inside v: a new page read from the file,
+// or, for text, a shared page from the cache. Pages past
+// the end of the file's part of the region are zero, like bss.
+// Returns 0 if out of memory or the file couldn't be read.
+char*
+vmapage(struct vma *v, uint64 va)
+{
+  uint64 off;
+  uint n;
+  int r, locked, text;
+  char *mem;
+
+  off = va - v->start;
+  n = 0;
+  if(off < v->filesz)
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+  if(n == 0)
+    return kalloc_zeroed();
+  text = (v->perm & (PTE_W|PTE_X)) == PTE_X;
+
+  // the fault may come from copyout() while readi() on
+  // this same file already holds its lock.
+  locked = holdingsleep(&v->ip->lock);
+  if(!locked)
+    ilock(v->ip);
+  mem = 0;
+  if(v->flags == 0 && v->gen != v->ip->gen)
+    goto out;  // the program file changed since exec().
+  if(text && (mem = textget(v->ip, v->off + off, n)) != 0)
+    goto out;
+  if((mem = kalloc_zeroed()) == 0)
+    goto out;
+  r = readi(v->ip, 0, (uint64)mem, v->off + off, n);
+  if(r < 0 || (r != n && v->flags == 0)){
+    // an mmap() region may extend past the end of the
+    // file, and reads there as zeroes.
+    kfree(mem);
+    mem = 0;
+    goto out;
+  }
+  if(text)
+    textput(v->ip, v->off + off, n, mem);
+ out:
+  if(!locked)
+    iunlock(v->ip);
+  return mem;
+}
+
+// Take [start, end), which must include v's start or its
+// end, out of region v. Returns 1 if nothing is left of v.
+static int
+vmacut(struct vma *v, uint64 start, uint64 end)
+{
+  uint64 len = end - start;
+
+  if(start == v->start){
+    v->off += len;
+    v->filesz = v->filesz > len ? v->filesz - len : 0;
+    v->start = end;
+  } else {
+    if(v->filesz > start - v->start)
+      v->filesz = start - v->start;
+    v->end = start;
+  }
+  return v->start == v->end;
+}
+
+// Give np the same regions as p, for fork(), including the
+// pages of p's mmap() regions. Returns 0 on success, or -1
+// if out of memory, in which case np has no regions.
+// Caller holds p->tg->lock.
+int
+vmadup(struct proc *np, struct proc *p)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &np->tg->vma[i];
+    *v = p->tg->vma[i];
+    if(v->ip == 0 || v->flags == 0)
+      continue;
+    // another thread's munmap() is taking this range away;
+    // the child doesn't get it.
+    if(p->tg->unmapend && p->tg->unmapstart >= v->start && p->tg->unmapstart < v->end &&
+       vmacut(v, p->tg->unmapstart, p->tg->unmapend))
+      continue;
+    if(uvmcopy(p->pagetable, np->pagetable, v->start, v->end, v->flags == MAP_SHARED) < 0)
+      goto bad;
+  }
+  for(i = 0; i < NVMA; i++){
+    v = &np->tg->vma[i];
+    if(v->start == v->end)
+      v->ip = 0;
+    if(v->ip)
+      idup(v->ip);
+  }
+  return 0;
+
+ bad:
+  while(--i >= 0){
+    v = &np->tg->vma[i];
+    if(v->ip && v->flags && v->start != v->end)
+      uvmunmap(np->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+  }
+  memset(np->tg->vma, 0, sizeof(np->tg->vma));
+  return -1;
+}
+
+// Drop the NVMA regions in vma[].
+// Must be called inside a transaction since it calls iput().
+void
+vmafree(struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].ip){
+      iput(vma[i].ip);
+      vma[i].ip = 0;
+    }
+  }
+}
+
+// The process has shrunk to sz bytes. Cut its regions
+// short, so that memory it grows into later is zeroed
+// rather than read from the file again.
+// Caller holds p->tg->lock.
+void
+vmatrim(struct proc *p, uint64 sz)
+{
+  struct vma *v;
+
+  sz = PGROUNDUP(sz);
+  for(v = p->tg->vma; v < &p->tg->vma[NVMA]; v++){
+    if(v->ip == 0 || v->flags || v->end <= sz)
+      continue;
+    v->end = (v->start < sz) ? sz : v->start;
+  }
+}
+
+// Fault in the pages of the user buffer [va, va+len) that
+// still have to be read from a file. copyin() and copyout()
+// can't wait for the disk while their caller holds a
+// spinlock, as piperead(), consoleread() and wait() do,
+// so system calls that may copy that way call this first.
+// This is only a hint, so it looks at the regions without
+// p->tg->lock; vmfault() checks again.
+void
+vmaprefault(uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, end;
+
+  if(va + len < va)
+    return;
+  for(v = p->tg->vma; v < &p->tg->vma[NVMA]; v++){
+    if(v->ip == 0)
+      continue;
+    end = va + len < v->end ? va + len : v->end;
+    for(a = PGROUNDDOWN(va > v->start ? va : v->start); a < end; a += PGSIZE){
+      if(walkaddr(p->pagetable, a) == 0)
+        vmfault(p->pagetable, a, 1);
+    }
+  }
+}
+
+// The lowest address used by p's mmap() regions;
+// the heap may not grow past it.
+// Caller holds p->tg->lock.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->tg->vma; v < &p->tg->vma[NVMA]; v++){
+    if(v->ip && v->flags && v->start < base)
+      base = v->start;
+  }
+  return base;
+}
+
+// Map len bytes of ip, starting at offset off, into the
+// current process, below its other mmap() regions.
+// Pages are read from the file when first touched.
+// Returns the region's address, or -1.
+uint64
+mmap(struct inode *ip, uint64 len, int prot, int flags, uint off)
+{
+  struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+  struct vma *v, *nv;
+  uint64 base;
+
+  len = PGROUNDUP(len);
+  acquire(&tg->lock);
+  base = mmapbase(p);
+  if(len == 0 || len > base || base - len < PGROUNDUP(tg->sz) ||
+     off + len < off){
+    release(&tg->lock);
+    return -1;
+  }
+
+  nv = 0;
+  for(v = tg->vma; v < &tg->vma[NVMA]; v++){
+    if(v->ip == 0){
+      nv = v;
+      break;
+    }
+  }
+  if(nv == 0){
+    release(&tg->lock);
+    return -1;
+  }
+
+  nv->start = base - len;
+  nv->end = base;
+  nv->perm = PTE_R | PTE_U;
+  if(prot & PROT_WRITE)
+    nv->perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    nv->perm |= PTE_X;
+  nv->ip = idup(ip);
+  nv->off = off;
+  // no file is longer than MAXFILE blocks, so the rest of a
+  // longer region is zero anyway.
+  nv->filesz = len < MAXFILE*BSIZE ? len : MAXFILE*BSIZE;
+  nv->flags = flags;
+  release(&tg->lock);
+  return base - len;
+}
+
+// Write the page of MAP_SHARED region v at va, whose memory
+// is at pa, back to the file, through the log. Only the part
+// of the page inside the file is written; a mapping never
+// makes the file longer.
+static void
+writeback(struct vma *v, uint64 va, char *pa)
+{
+  struct inode *ip = v->ip;
+  uint64 off = v->off + (va - v->start);
+  // at most this many bytes fit in one transaction;
+  // see filewrite().
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size){
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    if(n > ip->size - (off + i))
+      n = ip->size - (off + i);
+    // off + i < ip->size, so it fits in a uint.
+    writei(ip, 0, (uint64)pa + i, off + i, n);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// If v is MAP_SHARED, write the pages in [start, end) of v
+// that were written to back to the file. Pages past v's
+// file part have no place in the file, and are skipped.
+static void
+vmasync(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if(end > v->start + PGROUNDUP(v->filesz))
+    end = v->start + PGROUNDUP(v->filesz);
+  if(v->flags == MAP_SHARED && (v->perm & PTE_W)){
+    for(a = start; a < end; a += PGSIZE){
+      pte = walk(pagetable, a, 0);
+      if(pte && (*pte & PTE_V) && (*pte & PTE_D))
+        writeback(v, a, (char*)PTE2PA(*pte));
+    }
+  }
+}
+
+// Remove [start, end) of mmap() region v from pagetable,
+// writing the pages that were written to back to the file
+// first if v is MAP_SHARED. Doesn't change v itself.
+static void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  vmasync(pagetable, v, start, end);
+  uvmunmap(pagetable, start, (end - start) / PGSIZE, 1);
+}
+
+// Unmap [addr, addr+len) from the current process. The range
+// must lie in one mmap() region and include its start or its
+// end. Returns 0 on success, -1 on error.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct tgroup *tg = p->tg;
+  struct vma *v, old;
+  uint64 end;
+  int gone;
+
+  len = PGROUNDUP(len);
+  end = addr + len;
+  if(addr % PGSIZE != 0 || len == 0 || end < addr)
+    return -1;
+  acquire(&tg->lock);
+  // one munmap() at a time, so that the region can't change
+  // while the lock isn't held.
+  while(tg->unmapend)
+    sleep(&tg->unmapend, &tg->lock);
+  if((v = vmalookup(p, addr)) == 0 || v->flags == 0 || end > v->end ||
+     (addr != v->start && end != v->end)){  // would leave a hole.
+    release(&tg->lock);
+    return -1;
+  }
+
+  // the range stays in the region, so that mmap() can't
+  // reuse it, until it is unmapped; but faults in it fail
+  // from now on. wait for any that are reading the file.
+  tg->unmapstart = addr;
+  tg->unmapend = end;
+  while(tg->nfault > 0)
+    sleep(&tg->nfault, &tg->lock);
+
+  // keep the other threads from storing to pages after they
+  // have been written back.
+  old = *v;
+  if(v->flags == MAP_SHARED && (v->perm & PTE_W)){
+    uvmwprotect(p->pagetable, addr, len / PGSIZE);
+    if(tg->ref > 1)
+      tlbshootdown(tg);
+  }
+  release(&tg->lock);
+
+  vmasync(p->pagetable, &old, addr, end);
+
+  acquire(&tg->lock);
+  tgunmap(tg, addr, len / PGSIZE);
+  gone = vmacut(v, addr, end);
+  if(gone)
+    v->ip = 0;
+  tg->unmapstart = tg->unmapend = 0;
+  wakeup(&tg->unmapend);
+  release(&tg->lock);
+
+  if(gone){
+    begin_op();
+    iput(old.ip);
+    end_op();
+  }
+  return 0;
+}
+
+// Unmap all of the mmap() regions in vma[] from pagetable,
+// writing back MAP_SHARED pages, for exit() and exec().
+// The regions themselves are released by vmafree().
+void
+munmapall(pagetable_t pagetable, struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].ip && vma[i].flags)
+      vmaunmap(pagetable, &vma[i], vma[i].start, vma[i].end);
+  }
+}
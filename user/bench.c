@@ -0,0 +1,745 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+#include "kernel/riscv.h"
+
+//
+// Kernel performance benchmarks.  bench without arguments runs
+// them all and bench <name> runs just <name>.  Scaling
+// benchmarks start 1, 2, 4, ... NCPU worker processes at
+// once, let them run for BENCHTICKS clock ticks, and report
+// how many operations they completed in total.  Run xv6 with
+// different CPUS= settings to see how a kernel path scales
+// across harts.
+//
+
+#define BENCHTICKS 10
+
+// each worker's count from the last runworkers(), in the
+// order they finished.
+uint64 perworker[NPROC];
+
+// run nworkers copies of op() concurrently for BENCHTICKS
+// clock ticks; return the total number of completed calls.
+uint64
+runworkers(int nworkers, void op(void))
+{
+  int go[2], res[2], i;
+  uint64 n, total;
+  char c;
+
+  if(pipe(go) < 0 || pipe(res) < 0){
+    printf("bench: pipe failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < nworkers; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("bench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(go[1]);
+      close(res[0]);
+      // wait until every worker exists, then start together.
+      if(read(go[0], &c, 1) != 1)
+        exit(1);
+      n = 0;
+      int t0 = uptime();
+      while(uptime() - t0 < BENCHTICKS){
+        op();
+        n++;
+      }
+      write(res[1], &n, sizeof(n));
+      exit(0);
+    }
+  }
+  close(go[0]);
+  close(res[1]);
+  for(int i = 0; i < nworkers; i++)
+    write(go[1], "g", 1);
+  close(go[1]);
+
+  total = 0;
+  i = 0;
+  while(read(res[0], &n, sizeof(n)) == sizeof(n)){
+    total += n;
+    if(i < NPROC)
+      perworker[i++] = n;
+  }
+  close(res[0]);
+  for(int i = 0; i < nworkers; i++)
+    wait(0);
+  return total;
+}
+
+// report op()'s throughput with 1, 2, 4, ... NCPU workers.
+void
+scaling(char *s, void op(void))
+{
+  for(int n = 1; n <= NCPU; n *= 2){
+    uint64 ops = runworkers(n, op);
+    printf("%s: %d workers: %ld ops in %d ticks\n", s, n, ops, BENCHTICKS);
+  }
+}
+
+//
+// Physical page allocator.
+//
+
+#define KALLOCPAGES 16
+
+// grow the heap, touch every new page, and give it back,
+// so that each call does KALLOCPAGES kalloc()s and kfree()s.
+void
+kallocop(void)
+{
+  char *p = sbrk(KALLOCPAGES*PGSIZE);
+  if(p == (char*)-1){
+    printf("kalloc: sbrk failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < KALLOCPAGES; i++)
+    p[i*PGSIZE] = 1;
+  sbrk(-KALLOCPAGES*PGSIZE);
+}
+
+void
+kallocbench(char *s)
+{
+  scaling(s, kallocop);
+}
+
+//
+// fork() latency as a function of how much memory the
+// parent uses.
+//
+
+void
+forkop(void)
+{
+  int pid = fork();
+  if(pid < 0){
+    printf("fork: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+}
+
+void
+forkbench(char *s)
+{
+  for(int mb = 0; mb <= 16; mb = (mb == 0 ? 1 : mb*4)){
+    int sz = mb*1024*1024;
+    char *p = sbrk(sz);
+    if(p == (char*)-1){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(int i = 0; i < sz; i += PGSIZE)
+      p[i] = 1;
+    uint64 ops = runworkers(1, forkop);
+    printf("%s: %d MB heap: %ld forks in %d ticks\n", s, mb, ops, BENCHTICKS);
+    sbrk(-sz);
+  }
+}
+
+//
+// exec() latency for a small and a large program. Each
+// program is asked only to print its usage, so the time
+// goes to exec() and to faulting in the pages it touches.
+//
+
+char *execprog[3];
+
+void
+execop(void)
+{
+  int pid = fork();
+  if(pid < 0){
+    printf("exec: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    close(2);
+    exec(execprog[0], execprog);
+    exit(1);
+  }
+  wait(0);
+}
+
+void
+execbench(char *s)
+{
+  char *progs[] = { "echo", "usertests" };
+
+  for(int i = 0; i < 2; i++){
+    struct stat st;
+    if(stat(progs[i], &st) < 0){
+      printf("%s: cannot stat %s\n", s, progs[i]);
+      exit(1);
+    }
+    execprog[0] = progs[i];
+    execprog[1] = "-?";
+    uint64 ops = runworkers(1, execop);
+    printf("%s: %s (%d bytes): %ld execs in %d ticks\n", s, progs[i],
+           (int)st.size, ops, BENCHTICKS);
+  }
+}
+
+//
+// TLB reach: read one byte from every page of a HEAPMB heap,
+// backed once by 4096-byte pages and once by 2 MB megapages.
+//
+
+#define HEAPMB 16
+
+char *heap;
+volatile int sink;
+
+void
+sweepop(void)
+{
+  int sum = 0;
+
+  for(int i = 0; i < HEAPMB*1024*1024; i += PGSIZE)
+    sum += heap[i];
+  sink = sum;
+}
+
+void
+sbrkbench(char *s)
+{
+  int sz = HEAPMB*1024*1024;
+  uint64 ops;
+  char *p;
+  int pad;
+
+  // grow and touch the heap a page at a time, so that
+  // the kernel never sees a whole untouched 2 MB region.
+  heap = sbrk(0);
+  for(int i = 0; i < sz; i += PGSIZE){
+    if(sbrk(PGSIZE) == (char*)-1){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    heap[i] = 1;
+  }
+  ops = runworkers(1, sweepop);
+  printf("%s: 4 KB pages: %ld sweeps of %d MB in %d ticks\n", s, ops, HEAPMB, BENCHTICKS);
+  sbrk(-sz);
+
+  // one 2 MB-aligned sbrk(), so that each first touch
+  // maps a megapage.
+  p = sbrk(0);
+  pad = MEGAROUNDUP((uint64)p) - (uint64)p;
+  if(sbrk(pad) == (char*)-1 || (heap = sbrk(sz)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < sz; i += PGSIZE)
+    heap[i] = 1;
+  ops = runworkers(1, sweepop);
+  printf("%s: 2 MB pages: %ld sweeps of %d MB in %d ticks\n", s, ops, HEAPMB, BENCHTICKS);
+  sbrk(-(sz + pad));
+}
+
+//
+// scanning a file for newlines with read() into a buffer,
+// versus with mmap() and no copies.
+//
+
+#define SCANFILE "benchscan"
+#define SCANSIZE (200*1024)
+
+char scanbuf[512];
+
+void
+readscanop(void)
+{
+  int fd, n, lines = 0;
+
+  if((fd = open(SCANFILE, O_RDONLY)) < 0){
+    printf("mmap: open failed\n");
+    exit(1);
+  }
+  while((n = read(fd, scanbuf, sizeof(scanbuf))) > 0)
+    for(int i = 0; i < n; i++)
+      lines += (scanbuf[i] == '\n');
+  close(fd);
+  sink = lines;
+}
+
+void
+mmapscanop(void)
+{
+  int fd, lines = 0;
+  char *p;
+
+  if((fd = open(SCANFILE, O_RDONLY)) < 0){
+    printf("mmap: open failed\n");
+    exit(1);
+  }
+  p = mmap(0, SCANSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("mmap: mmap failed\n");
+    exit(1);
+  }
+  for(int i = 0; i < SCANSIZE; i++)
+    lines += (p[i] == '\n');
+  munmap(p, SCANSIZE);
+  close(fd);
+  sink = lines;
+}
+
+void
+mmapbench(char *s)
+{
+  int fd;
+
+  if((fd = open(SCANFILE, O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < sizeof(scanbuf); i++)
+    scanbuf[i] = (i % 64 == 63) ? '\n' : 'x';
+  for(int i = 0; i < SCANSIZE; i += sizeof(scanbuf)){
+    if(write(fd, scanbuf, sizeof(scanbuf)) != sizeof(scanbuf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  printf("%s: read: %ld scans of %d KB in %d ticks\n", s,
+         runworkers(1, readscanop), SCANSIZE/1024, BENCHTICKS);
+  printf("%s: mmap: %ld scans of %d KB in %d ticks\n", s,
+         runworkers(1, mmapscanop), SCANSIZE/1024, BENCHTICKS);
+  unlink(SCANFILE);
+}
+
+//
+// scheduling overhead: many CPU-bound processes, so that
+// every timer tick makes each hart pick another process.
+// The total work done is what's left after scheduling;
+// compare runs with CPUS=1 and CPUS=8.
+//
+
+#define NBUSY (NPROC-4)  // leave room for init, sh and bench
+
+void
+busyop(void)
+{
+  for(int i = 0; i < 1000; i++)
+    sink = i;
+}
+
+void
+schedbench(char *s)
+{
+  printf("%s: %d busy processes: %ld ops in %d ticks\n", s, NBUSY,
+         runworkers(NBUSY, busyop), BENCHTICKS);
+}
+
+//
+// interactive latency: round trips of "echo x" through sh,
+// alone and with NHOG CPU-bound processes running. The hogs
+// soon use up their time slices and drop to the lowest
+// priority, while sh and echo, which mostly sleep, do not.
+//
+
+#define NHOG (2*NCPU)
+
+void
+latencybench(char *s)
+{
+  int in[2], out[2], pids[NHOG], pid, n;
+  char c;
+
+  for(int nhog = 0; nhog <= NHOG; nhog += NHOG){
+    for(int i = 0; i < nhog; i++){
+      if((pids[i] = fork()) < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pids[i] == 0)
+        for(;;)
+          sink++;
+    }
+
+    if(pipe(in) < 0 || pipe(out) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(0);
+      dup(in[0]);
+      close(1);
+      dup(out[1]);
+      close(2);
+      dup(out[1]);
+      close(in[0]);
+      close(in[1]);
+      close(out[0]);
+      close(out[1]);
+      char *argv[] = { "sh", 0 };
+      exec("sh", argv);
+      exit(1);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    // each round trip ends with echo's newline; sh's
+    // "$ " prompts come before it.
+    n = 0;
+    int t0 = uptime();
+    while(uptime() - t0 < BENCHTICKS){
+      write(in[1], "echo x\n", 7);
+      do {
+        if(read(out[0], &c, 1) != 1){
+          printf("%s: sh died\n", s);
+          exit(1);
+        }
+      } while(c != '\n');
+      n++;
+    }
+    close(in[1]);
+    close(out[0]);
+
+    for(int i = 0; i < nhog; i++)
+      kill(pids[i]);
+    for(int i = 0; i < nhog + 1; i++)
+      wait(0);
+    printf("%s: %d hogs: %d echoes in %d ticks\n", s, nhog, n, BENCHTICKS);
+  }
+}
+
+//
+// context switch latency: two processes pass a byte back
+// and forth over a pair of pipes, so that each round trip
+// is two sleeps and two wakeups. With CPUS=1 every round
+// trip is two process-to-process switches.
+//
+
+// run the ping-pong for BENCHTICKS; return the round trips.
+int
+pingpong(char *s)
+{
+  int ping[2], pong[2], pid, n;
+  int t0;
+  char c = 0;
+
+  if(pipe(ping) < 0 || pipe(pong) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(ping[1]);
+    close(pong[0]);
+    while(read(ping[0], &c, 1) == 1)
+      write(pong[1], &c, 1);
+    exit(0);
+  }
+  close(ping[0]);
+  close(pong[1]);
+
+  n = 0;
+  t0 = uptime();
+  while(uptime() - t0 < BENCHTICKS){
+    if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+      printf("%s: pingpong failed\n", s);
+      exit(1);
+    }
+    n++;
+  }
+  close(ping[1]);
+  close(pong[0]);
+  wait(0);
+  return n;
+}
+
+void
+switchbench(char *s)
+{
+  printf("%s: %d round trips in %d ticks\n", s, pingpong(s), BENCHTICKS);
+}
+
+//
+// wakeup-to-run latency: the same ping-pong with CPUS=2 or
+// more, where the child starts on a different, idle, hart.
+// Each wakeup then has to get a sleeping hart running.
+//
+
+void
+wakeupbench(char *s)
+{
+  int n = pingpong(s);
+  int us = n ? BENCHTICKS * 100000 / (2 * n) : 0;
+
+  printf("%s: %d round trips in %d ticks, %d us per wakeup\n", s, n, BENCHTICKS, us);
+}
+
+//
+// parallel sum: 1, 2, 4, ... NCPU threads of one process
+// sum their shares of one array, over and over, for
+// BENCHTICKS. The threads share the array, so this shows
+// whether they spread across the harts.
+//
+
+#define NSUM (64*1024)
+
+uint64 *sumarr;
+volatile int sumstop;
+
+struct sumarg {
+  int lo, hi;       // share of sumarr
+  uint64 passes;    // times the thread summed its share
+  uint64 sum;
+};
+
+void
+sumthread(void *a)
+{
+  struct sumarg *sa = a;
+  uint64 passes = 0, sum = 0;
+
+  do {
+    sum = 0;
+    for(int i = sa->lo; i < sa->hi; i++)
+      sum += sumarr[i];
+    passes++;
+  } while(!sumstop);
+  sa->passes = passes;
+  sa->sum = sum;
+}
+
+void
+sumbench(char *s)
+{
+  struct sumarg args[NCPU];
+  uint64 want, got, total;
+
+  if((sumarr = malloc(NSUM * sizeof(uint64))) == 0){
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  want = 0;
+  for(int i = 0; i < NSUM; i++){
+    sumarr[i] = i;
+    want += i;
+  }
+
+  for(int n = 1; n <= NCPU; n *= 2){
+    sumstop = 0;
+    for(int t = 0; t < n; t++){
+      args[t].lo = NSUM / n * t;
+      args[t].hi = NSUM / n * (t + 1);
+      if(thread_create(sumthread, &args[t]) < 0){
+        printf("%s: thread_create failed\n", s);
+        exit(1);
+      }
+    }
+    sleep(BENCHTICKS);
+    sumstop = 1;
+    for(int t = 0; t < n; t++)
+      thread_join();
+
+    got = total = 0;
+    for(int t = 0; t < n; t++){
+      got += args[t].sum;
+      total += args[t].passes * (args[t].hi - args[t].lo);
+    }
+    if(got != want){
+      printf("%s: sum %ld, want %ld\n", s, got, want);
+      exit(1);
+    }
+    printf("%s: %d threads: %ld elements in %d ticks\n", s, n, total, BENCHTICKS);
+  }
+  free(sumarr);
+}
+
+//
+// spinlock contention: every uptime() system call takes
+// tickslock, so 1, 2, 4, ... NCPU workers calling it in a
+// loop contend for that one lock. Besides the throughput,
+// the spread between the busiest and the least busy worker
+// shows how fairly the lock is handed out.
+//
+
+void
+uptimeop(void)
+{
+  uptime();
+}
+
+void
+lockbench(char *s)
+{
+  uint64 ops, lo, hi;
+
+  for(int n = 1; n <= NCPU; n *= 2){
+    ops = runworkers(n, uptimeop);
+    lo = hi = perworker[0];
+    for(int i = 1; i < n; i++){
+      if(perworker[i] < lo)
+        lo = perworker[i];
+      if(perworker[i] > hi)
+        hi = perworker[i];
+    }
+    printf("%s: %d workers: %ld ops in %d ticks, per worker %ld to %ld\n",
+           s, n, ops, BENCHTICKS, lo, hi);
+  }
+}
+
+//
+// buffer cache lookups: each worker reads a small file of
+// its own over and over. The files fit in the buffer cache,
+// so each read() is bget() and brelse() of cached blocks,
+// and workers on different harts look up different blocks.
+//
+
+#define BREADBLOCKS 2
+
+char breadbuf[BSIZE];
+
+void
+breadop(void)
+{
+  char name[] = "benchbread0";
+  int fd;
+
+  name[10] = '0' + getpid() % NCPU;
+  if((fd = open(name, O_RDONLY)) < 0){
+    printf("bread: open %s failed\n", name);
+    exit(1);
+  }
+  while(read(fd, breadbuf, sizeof(breadbuf)) > 0)
+    ;
+  close(fd);
+}
+
+void
+breadbench(char *s)
+{
+  char name[] = "benchbread0";
+  int fd;
+
+  for(int i = 0; i < NCPU; i++){
+    name[10] = '0' + i;
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    for(int j = 0; j < BREADBLOCKS; j++)
+      write(fd, breadbuf, sizeof(breadbuf));
+    close(fd);
+  }
+  scaling(s, breadop);
+  for(int i = 0; i < NCPU; i++){
+    name[10] = '0' + i;
+    unlink(name);
+  }
+}
+
+//
+// a working set bigger than the NBUF fixed buffers: read a
+// BIGBLOCKS-block file over and over. Unless the buffer cache
+// has grown to hold it, every pass reads it from the disk.
+//
+
+#define BIGFILE "benchbig"
+#define BIGBLOCKS 200
+
+void
+bigreadop(void)
+{
+  int fd;
+
+  if((fd = open(BIGFILE, O_RDONLY)) < 0){
+    printf("bigread: open failed\n");
+    exit(1);
+  }
+  while(read(fd, breadbuf, sizeof(breadbuf)) > 0)
+    ;
+  close(fd);
+}
+
+void
+bigreadbench(char *s)
+{
+  int fd;
+
+  if((fd = open(BIGFILE, O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < BIGBLOCKS; i++){
+    if(write(fd, breadbuf, sizeof(breadbuf)) != sizeof(breadbuf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  uint64 ops = runworkers(1, bigreadop);
+  printf("%s: %d blocks: %ld passes in %d ticks\n", s, BIGBLOCKS, ops, BENCHTICKS);
+  unlink(BIGFILE);
+}
+
+struct bench {
+  void (*f)(char *);
+  char *s;
+} benches[] = {
+  {kallocbench, "kalloc"},
+  {forkbench, "fork"},
+  {execbench, "exec"},
+  {sbrkbench, "sbrk"},
+  {mmapbench, "mmap"},
+  {schedbench, "sched"},
+  {latencybench, "latency"},
+  {switchbench, "switch"},
+  {wakeupbench, "wakeup"},
+  {sumbench, "sum"},
+  {lockbench, "lock"},
+  {breadbench, "bread"},
+  {bigreadbench, "bigread"},
+  { 0, 0},
+};
+
+int
+main(int argc, char *argv[])
+{
+  char *justone = 0;
+  int found = 0;
+
+  if(argc == 2 && argv[1][0] != '-'){
+    justone = argv[1];
+  } else if(argc > 1){
+    printf("Usage: bench [benchname]\n");
+    exit(1);
+  }
+  for(struct bench *b = benches; b->s != 0; b++){
+    if(justone == 0 || strcmp(b->s, justone) == 0){
+      b->f(b->s);
+      found = 1;
+    }
+  }
+  if(!found){
+    printf("bench: no benchmark %s\n", justone);
+    exit(1);
+  }
+  exit(0);
+}
@@ -0,0 +1,87 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+//
+// Print the spinlocks that were most often found held.
+// lockstat alone reports the counts since boot; lockstat
+// command [args...] reports only what happened while the
+// command ran, e.g. lockstat usertests -q. The longest hold
+// is since boot either way.
+//
+
+#define NTOP 20
+
+struct lockstat before[NLOCKSTAT], after[NLOCKSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  int n0, n, pid, i, j, top[NTOP], ntop;
+
+  n0 = 0;
+  if(argc > 1){
+    if((n0 = lockstat(before, NLOCKSTAT)) < 0){
+      fprintf(2, "lockstat: lockstat failed\n");
+      exit(1);
+    }
+    if((pid = fork()) < 0){
+      fprintf(2, "lockstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      fprintf(2, "lockstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+  if((n = lockstat(after, NLOCKSTAT)) < 0){
+    fprintf(2, "lockstat: lockstat failed\n");
+    exit(1);
+  }
+
+  // lock names keep their places, and new ones come last.
+  for(i = 0; i < n0; i++){
+    after[i].nacquire -= before[i].nacquire;
+    after[i].ncontend -= before[i].ncontend;
+    after[i].nspin -= before[i].nspin;
+    after[i].nsleep -= before[i].nsleep;
+    after[i].nspinwait -= before[i].nspinwait;
+  }
+
+  // pick the NTOP most contended.
+  ntop = 0;
+  for(i = 0; i < n; i++){
+    if(after[i].nacquire == 0)
+      continue;
+    for(j = ntop; j > 0 && after[top[j-1]].ncontend < after[i].ncontend; j--)
+      if(j < NTOP)
+        top[j] = top[j-1];
+    if(j < NTOP){
+      top[j] = i;
+      if(ntop < NTOP)
+        ntop++;
+    }
+  }
+
+  printf("name\t\tacquired\tcontended\tspins\tmax hold (us)\n");
+  for(i = 0; i < ntop; i++){
+    struct lockstat *st = &after[top[i]];
+    printf("%s\t%s%ld\t\t%ld\t\t%ld\t%ld\n", st->name, strlen(st->name) < 8 ? "\t" : "",
+           st->nacquire, st->ncontend, st->nspin, st->maxhold / 10);
+  }
+
+  // sleep locks: how often a waiter slept, and how often it
+  // spun while the holder ran instead.
+  printf("\nsleep lock\tsleeps\t\tspun instead\n");
+  for(i = 0; i < n; i++){
+    struct lockstat *st = &after[i];
+    if(st->nsleep == 0 && st->nspinwait == 0)
+      continue;
+    printf("%s\t%s%ld\t\t%ld\n", st->name, strlen(st->name) < 8 ? "\t" : "",
+           st->nsleep, st->nspinwait);
+  }
+  exit(0);
+}
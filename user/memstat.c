@@ -0,0 +1,44 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+//
+// Print the physical memory allocator's statistics.
+// For each block order, "frag" is the percentage of free
+// memory that sits in blocks too small to satisfy an
+// allocation of that order.
+//
+
+int
+main(void)
+{
+  struct memstat st;
+  uint64 total, small;
+
+  if(memstat(&st) < 0){
+    fprintf(2, "memstat: memstat failed\n");
+    exit(1);
+  }
+
+  total = 0;
+  for(int k = 0; k <= MAXORDER; k++)
+    total += st.nfree[k] << k;
+  printf("free pages: %ld in buddy allocator, %ld cached on CPUs\n",
+         total, st.ncached);
+  printf("per-CPU refills: %ld, steals: %ld\n", st.nrefill, st.nsteal);
+  printf("zero pool: %ld pages, %ld hits, %ld misses\n",
+         st.nzero, st.nzerohit, st.nzeromiss);
+
+  printf("order   free  frag%%   allocs  fails  avg cycles\n");
+  small = 0;
+  for(int k = 0; k <= MAXORDER; k++){
+    uint64 frag = total ? small * 100 / total : 0;
+    uint64 n = st.nalloc[k] + st.nfail[k];
+    uint64 avg = n ? st.time[k] / n : 0;
+    printf("%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", k, st.nfree[k], frag,
+           st.nalloc[k], st.nfail[k], avg);
+    small += st.nfree[k] << k;
+  }
+  exit(0);
+}
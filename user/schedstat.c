@@ -0,0 +1,30 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/schedstat.h"
+#include "user/user.h"
+
+//
+// Print each CPU's scheduler statistics: how many processes
+// are waiting on its run queue, how many times it switched
+// to a process, and how much work moved between CPUs.
+//
+
+struct schedstat st[NCPU];
+
+int
+main(void)
+{
+  if(schedstat(st) < 0){
+    fprintf(2, "schedstat: schedstat failed\n");
+    exit(1);
+  }
+
+  printf("cpu  queued  runs  steals  pushes  migrations\n");
+  for(int i = 0; i < NCPU; i++){
+    if(!st[i].online)
+      continue;
+    printf("%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", i, st[i].nqueued, st[i].nrun,
+           st[i].nsteal, st[i].npush, st[i].nmigrate);
+  }
+  exit(0);
+}
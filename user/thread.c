@@ -0,0 +1,137 @@
+// Threads, built on clone() and join(), and mutexes and
+// condition variables for them, built on futex_wait() and
+// futex_wake().
+//
+// Each thread gets a stack of TSTACK bytes from malloc().
+// malloc() isn't safe to call from more than one thread at
+// once, so only one thread should create and join threads.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define TSTACK 4096
+
+// what a new thread is to run, kept at the top of its stack.
+struct start {
+  void (*fn)(void*);
+  void *arg;
+};
+
+static void
+threadstart(void *a)
+{
+  struct start *s = a;
+
+  s->fn(s->arg);
+  exit(0);
+}
+
+// Start a thread running fn(arg). Returns its pid, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  struct start *s;
+  int pid;
+
+  if((stack = malloc(TSTACK)) == 0)
+    return -1;
+  s = (struct start*)(stack + TSTACK) - 1;
+  s->fn = fn;
+  s->arg = arg;
+  if((pid = clone(threadstart, s, s)) < 0)
+    free(stack);
+  return pid;
+}
+
+// Wait for a thread this thread created to finish, and free
+// its stack. Returns its pid, or -1 if there are none.
+int
+thread_join(void)
+{
+  void *top;
+  int pid;
+
+  if((pid = join(&top)) < 0)
+    return -1;
+  free((char*)((struct start*)top + 1) - TSTACK);
+  return pid;
+}
+
+// A mutex's state is 0 when it is free, 1 when it is held, and
+// 2 when it is held and other threads may be waiting for it.
+// Taking a free mutex, or releasing one no one waits for, is
+// a single atomic instruction; only waiting and waking up the
+// waiters enter the kernel.
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  uint c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  // mark it contended, so that mutex_unlock() wakes us,
+  // and sleep until it is free.
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_lock_release(&m->state);
+    futex_wake(&m->state, 1);
+  }
+}
+
+// A condition variable's seq changes at each signal, so that
+// a signal between cond_wait()'s unlock and its sleep makes
+// the sleep return at once.
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+}
+
+// Release m, wait for a signal, and take m again. As with
+// any condition variable, the caller must check its condition
+// again when this returns.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  uint seq = *(volatile uint*)&c->seq;
+
+  mutex_unlock(m);
+  futex_wait(&c->seq, seq);
+  // other threads woken with this one may be waiting for m,
+  // so take it as contended.
+  while(__sync_lock_test_and_set(&m->state, 2) != 0)
+    futex_wait(&m->state, 2);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}
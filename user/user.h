@@ -1,4 +1,7 @@
 struct stat;
+struct memstat;
+struct schedstat;
+struct lockstat;
 
 // system calls
 int fork(void);
@@ -22,6 +25,18 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int memstat(struct memstat*);
+void* mmap(void*, uint64, int, int, int, int);
+int munmap(void*, uint64);
+int schedstat(struct schedstat*);
+int nice(int);
+int setpriority(int, int);
+int nanosleep(uint64);
+int clone(void (*)(void*), void*, void*);
+int join(void**);
+int futex_wait(uint*, uint);
+int futex_wake(uint*, int);
+int lockstat(struct lockstat*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -41,3 +56,20 @@ void *memcpy(void *, const void *, uint);
 // umalloc.c
 void* malloc(uint);
 void free(void*);
+
+// thread.c
+struct mutex {
+  uint state;
+};
+struct cond {
+  uint seq;
+};
+int thread_create(void (*)(void*), void*);
+int thread_join(void);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
@@ -5,6 +5,9 @@
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
 #include "kernel/syscall.h"
+#include "kernel/memstat.h"
+#include "kernel/schedstat.h"
+#include "kernel/lockstat.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
 
@@ -1920,13 +1923,15 @@ dirfile(char *s)
 }
 
 // test that iput() is called at the end of _namei().
-// also tests empty file names.
+// also tests empty file names. goes one directory deeper
+// than the kernel's fixed inode table, of 50, once held.
 void
 iref(char *s)
 {
+  enum { N = 50 + 1 };
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1948,7 +1953,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -2571,19 +2576,1040 @@ sbrk8000(char *s)
 
 
 
-// regression test. test whether exec() leaks memory if one of the
-// arguments is invalid. the test passes if the kernel doesn't panic.
+// does sbrk() only reserve memory? a process can grow far past
+// the size of physical memory as long as it touches few pages,
+// untouched pages must read as zero, and system calls must be
+// able to use untouched pages as buffers.
 void
-badarg(char *s)
+lazysbrk(char *s)
 {
-  for(int i = 0; i < 50000; i++){
-    char *argv[2];
-    argv[0] = (char*)0xffffffff;
-    argv[1] = 0;
+  enum { BIG = 1024*1024*1024 };
+  int fd, fds[2];
+  char *a;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+  a[0] = 1;
+  a[BIG-1] = 1;
+  if(a[BIG/2] != 0 || a[BIG/2 + PGSIZE - 1] != 0){
+    printf("%s: untouched heap page not zero\n", s);
+    exit(1);
+  }
+
+  // copyout() into an untouched page.
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a + BIG/4, 10) != 10){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // copyin() from an untouched page.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + BIG/4*3, 10) != 10){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], buf, 10) != 10 || buf[0] != 0 || buf[9] != 0){
+    printf("%s: untouched page did not read as zero\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  sbrk(-BIG);
+}
+
+// does fork() share memory copy-on-write? a process using more
+// than half of physical memory can only fork if the child does
+// not get its own copy of every page, and each process must
+// still see only its own writes.
+void
+cowfork(char *s)
+{
+  enum { SZ = 64*1024*1024 };
+  int pid, xstatus;
+  uint64 i;
+  char *p;
+
+  p = sbrk(SZ);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, SZ);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE)
+    p[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < SZ; i += PGSIZE){
+      if(p[i] != (char)(i / PGSIZE)){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    p[0] = 'c';
+    p[SZ-PGSIZE] = 'c';
+    exit(0);
+  }
+  p[PGSIZE] = 'p';
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(p[0] != 0 || p[PGSIZE] != 'p' || p[SZ-PGSIZE] != (char)(SZ/PGSIZE - 1)){
+    printf("%s: parent sees child's writes\n", s);
+    exit(1);
+  }
+  sbrk(-SZ);
+}
+
+// can the kernel's copyout() write into a copy-on-write page,
+// without the parent seeing the write?
+void
+cowcopyout(char *s)
+{
+  int fds[2], pid, xstatus;
+
+  buf[0] = 'a';
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    if(read(fds[0], buf, 1) != 1 || buf[0] != 'b')
+      exit(1);
+    exit(0);
+  }
+  close(fds[0]);
+  write(fds[1], "b", 1);
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(buf[0] != 'a'){
+    printf("%s: read() in child changed parent memory\n", s);
+    exit(1);
+  }
+}
+
+// the kernel reads a program in from its file on first touch.
+// exec a fresh program, none of whose pages this process has
+// touched, and check that it runs correctly.
+void
+demandexec(char *s)
+{
+  int fds[2], pid, xstatus, n, m;
+  char *argv[] = { "echo", "demand", "paged", 0 };
+  char *want = "demand paged\n";
+  char b[32];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    dup(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
     exec("echo", argv);
+    exit(1);
   }
-  
-  exit(0);
+  close(fds[1]);
+  n = 0;
+  while(n < sizeof(b) && (m = read(fds[0], b + n, sizeof(b) - n)) > 0)
+    n += m;
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: exec echo failed\n", s);
+    exit(1);
+  }
+  if(n != strlen(want) || memcmp(b, want, n) != 0){
+    printf("%s: echo printed the wrong thing\n", s);
+    exit(1);
+  }
+}
+
+// free pages, wherever the allocator keeps them: idle CPUs
+// move pages to the zero pool at any time.
+uint64
+freepages(char *s)
+{
+  struct memstat st;
+  uint64 n;
+
+  if(memstat(&st) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  n = st.ncached + st.nzero;
+  for(int k = 0; k <= MAXORDER; k++)
+    n += st.nfree[k] << k;
+  return n;
+}
+
+// the allocator's free page count should drop while
+// a process holds memory, and come back when it frees it.
+void
+memstats(char *s)
+{
+  enum { N = 256 };
+  uint64 before, during, after;
+  char *a;
+
+  before = freepages(s);
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++)
+    a[i*PGSIZE] = 1;
+  during = freepages(s);
+  sbrk(-N*PGSIZE);
+  after = freepages(s);
+  if(during + N > before || after < during + N){
+    printf("%s: free pages %ld, %ld, %ld\n", s, before, during, after);
+    exit(1);
+  }
+}
+
+// open more files at once, across processes, than the
+// kernel's old fixed-size file table could hold.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 10, NPIPE = (NOFILE - 5) / 2 };
+  int go[2], ready[2], fds[2], pid, xstatus;
+  char c;
+
+  if(pipe(go) < 0 || pipe(ready) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(go[1]);
+      close(ready[0]);
+      for(int j = 0; j < NPIPE; j++){
+        if(pipe(fds) < 0){
+          printf("%s: pipe %d in child %d failed\n", s, j, i);
+          exit(1);
+        }
+      }
+      // hold the pipes open until every child has its own.
+      write(ready[1], "r", 1);
+      read(go[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(go[0]);
+  close(ready[1]);
+  for(int i = 0; i < NCHILD; i++){
+    if(read(ready[0], &c, 1) != 1)
+      break;
+  }
+  close(ready[0]);
+  close(go[1]);
+  for(int i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+// a large (at least MEGAHEAP), aligned heap gets megapages.
+// check that fork() copies them, and that shrinking the heap
+// to the middle of one and growing it again gives back
+// zeroed memory.
+void
+megapages(char *s)
+{
+  enum { SZ = 2*MEGASIZE };
+  char *p, *a;
+  int pad, pid, xstatus;
+
+  p = sbrk(0);
+  pad = MEGAROUNDUP((uint64)p) - (uint64)p;
+  if(sbrk(pad) == (char*)-1 || (a = sbrk(SZ)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i += PGSIZE)
+    a[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 0; i < SZ; i += PGSIZE){
+      if(a[i] != (char)(i / PGSIZE)){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+      a[i] = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(int i = 0; i < SZ; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: child's writes changed parent\n", s);
+      exit(1);
+    }
+  }
+
+  // cut the second megapage in half.
+  sbrk(-MEGASIZE/2);
+  for(int i = 0; i < SZ - MEGASIZE/2; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE)){
+      printf("%s: shrinking lost data\n", s);
+      exit(1);
+    }
+  }
+  sbrk(MEGASIZE/2);
+  for(int i = SZ - MEGASIZE/2; i < SZ; i += PGSIZE){
+    if(a[i] != 0){
+      printf("%s: regrown heap not zero\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-(SZ + pad));
+}
+
+// mmap() a file privately and shared, and check what the
+// file and a forked child see.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*PGSIZE + 100 };
+  char *f = "mmaptest.tmp";
+  char *a;
+  int fd, pid, xstatus;
+
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i++){
+    char c = 'a' + i % 26;
+    if(write(fd, &c, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  // private: writes don't reach the file.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i++){
+    if(a[i] != 'a' + i % 26){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(a[SZ] != 0 || a[3*PGSIZE - 1] != 0){
+    printf("%s: past end of file not zero\n", s);
+    exit(1);
+  }
+  a[0] = 'X';
+  if(munmap(a, SZ) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // shared: a child's writes are seen by the parent at once,
+  // and reach the file when unmapped.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a'){
+    printf("%s: private write reached the file\n", s);
+    exit(1);
+  }
+  a[PGSIZE] = 'P';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[PGSIZE] != 'P')
+      exit(1);
+    a[1] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || a[1] != 'C'){
+    printf("%s: child didn't share the mapping\n", s);
+    exit(1);
+  }
+  if(munmap(a, PGSIZE) < 0 || munmap(a + PGSIZE, SZ - PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(f, O_RDONLY);
+  if(read(fd, buf, PGSIZE + 1) != PGSIZE + 1 ||
+     buf[1] != 'C' || buf[PGSIZE] != 'P'){
+    printf("%s: shared writes didn't reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+}
+
+// total process switches across CPUs, from schedstat().
+uint64
+totalruns(char *s)
+{
+  static struct schedstat st[NCPU];
+  uint64 n = 0;
+  int online = 0;
+
+  if(schedstat(st) < 0){
+    printf("%s: schedstat failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NCPU; i++){
+    online += (st[i].online != 0);
+    n += st[i].nrun;
+  }
+  if(online == 0){
+    printf("%s: no CPUs online\n", s);
+    exit(1);
+  }
+  return n;
+}
+
+// every forked child is switched to at least once.
+void
+schedstats(char *s)
+{
+  enum { N = 8 };
+  uint64 before, after;
+
+  before = totalruns(s);
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+  }
+  for(int i = 0; i < N; i++)
+    wait(0);
+  after = totalruns(s);
+  if(after < before + N){
+    printf("%s: %ld runs before, %ld after %d forks\n", s, before, after, N);
+    exit(1);
+  }
+}
+
+void
+nicetest(char *s)
+{
+  int pid = getpid();
+
+  if(nice(0) != 0){
+    printf("%s: initial nice %d\n", s, nice(0));
+    exit(1);
+  }
+  if(nice(1) != 1 || nice(100) != NPRIO-1 || nice(-100) != 0){
+    printf("%s: nice did not clamp\n", s);
+    exit(1);
+  }
+  if(setpriority(pid, NPRIO-1) != 0 || nice(0) != NPRIO-1){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+  if(setpriority(pid, NPRIO) != -1 || setpriority(pid, -1) != -1){
+    printf("%s: setpriority accepted a bad value\n", s);
+    exit(1);
+  }
+  if(setpriority(-1, 0) != -1){
+    printf("%s: setpriority accepted a bad pid\n", s);
+    exit(1);
+  }
+
+  // a child inherits its parent's nice value.
+  int cpid = fork();
+  if(cpid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(cpid == 0)
+    exit(nice(0));
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != NPRIO-1){
+    printf("%s: child nice %d\n", s, xstatus);
+    exit(1);
+  }
+  nice(-100);
+}
+
+// several readers and writers on one pipe, so that a
+// wakeup_one() that isn't passed on leaves someone asleep.
+void
+pipecrowd(char *s)
+{
+  enum { NR = 4, NW = 4, N = 2000 };
+  int fds[2], res[2], pid, n, total;
+  char buf[7];
+
+  if(pipe(fds) < 0 || pipe(res) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NR + NW; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(res[0]);
+      if(i < NR){
+        // reader: count bytes until every writer is done.
+        close(fds[1]);
+        total = 0;
+        while((n = read(fds[0], buf, 1 + i)) > 0)
+          total += n;
+        write(res[1], &total, sizeof(total));
+      } else {
+        close(fds[0]);
+        for(total = 0; total < N; total += n){
+          n = sizeof(buf) < N - total ? sizeof(buf) : N - total;
+          if(write(fds[1], buf, n) != n){
+            printf("%s: write failed\n", s);
+            exit(1);
+          }
+        }
+      }
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(res[1]);
+  total = 0;
+  for(int i = 0; i < NR; i++){
+    if(read(res[0], &n, sizeof(n)) != sizeof(n)){
+      printf("%s: reader died\n", s);
+      exit(1);
+    }
+    total += n;
+  }
+  close(res[0]);
+  for(int i = 0; i < NR + NW; i++)
+    wait(0);
+  if(total != NW*N){
+    printf("%s: read %d bytes, wanted %d\n", s, total, NW*N);
+    exit(1);
+  }
+}
+
+// nanosleep() sleeps for less than a clock tick, and
+// kill() ends a long one early.
+void
+nanosleeptest(char *s)
+{
+  enum { N = 20 };
+  int t0, pid, xstatus;
+
+  if(nanosleep(0) != 0){
+    printf("%s: nanosleep(0) failed\n", s);
+    exit(1);
+  }
+  t0 = uptime();
+  for(int i = 0; i < N; i++){
+    if(nanosleep(1000000) != 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  if(uptime() - t0 > 3){
+    printf("%s: %d 1 ms sleeps took %d ticks\n", s, N, uptime() - t0);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    nanosleep(100 * 1000000000L);
+    exit(0);
+  }
+  sleep(1);
+  t0 = uptime();
+  kill(pid);
+  wait(&xstatus);
+  if(uptime() - t0 > 3){
+    printf("%s: killed sleeper took %d ticks to exit\n", s, uptime() - t0);
+    exit(1);
+  }
+}
+
+// threads share memory, open files and the current directory.
+#define NTHR 4
+int thrslot[NTHR];
+int thrfd = -1;
+
+void
+thrwork(void *a)
+{
+  int i = (int)(uint64)a;
+
+  thrslot[i] = i + 1;
+  if(i == 0)
+    thrfd = open("thrfile", O_CREATE|O_RDWR);
+}
+
+void
+thrspin(void *a)
+{
+  for(;;)
+    ;
+}
+
+void
+threadtest(char *s)
+{
+  int fds[2], pid;
+  char c;
+
+  for(int i = 0; i < NTHR; i++){
+    if(thread_create(thrwork, (void*)(uint64)i) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < NTHR; i++){
+    if(thread_join() < 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(thread_join() != -1){
+    printf("%s: thread_join with no threads succeeded\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < NTHR; i++){
+    if(thrslot[i] != i + 1){
+      printf("%s: thread %d's store not seen\n", s, i);
+      exit(1);
+    }
+  }
+  if(thrfd < 0 || write(thrfd, "x", 1) != 1){
+    printf("%s: thread's file descriptor not shared\n", s);
+    exit(1);
+  }
+  close(thrfd);
+  unlink("thrfile");
+
+  // when a process's first thread exits, the others go too,
+  // and with them the last copy of the pipe's write end.
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    if(thread_create(thrspin, 0) < 0)
+      exit(1);
+    exit(0);
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 0){
+    printf("%s: read from pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  wait(0);
+}
+
+// threads store to the same pages at once, the first time
+// each page is touched, and then again after a fork() has
+// made them copy-on-write; every thread's fault must succeed.
+#define NFPAGE 8
+char *thrpages;
+volatile int thrgo;
+
+void
+thrstore(void *a)
+{
+  int i = (int)(uint64)a;
+
+  while(thrgo == 0)
+    ;
+  for(int pg = 0; pg < NFPAGE; pg++)
+    thrpages[pg*PGSIZE + i] = i + 1;
+}
+
+void
+threadfaulttest(char *s)
+{
+  int fds[2], pid, round, i;
+  char c;
+
+  for(round = 0; round < 2; round++){
+    if(round == 0){
+      if((thrpages = sbrk(NFPAGE*PGSIZE)) == (char*)-1){
+        printf("%s: sbrk failed\n", s);
+        exit(1);
+      }
+    } else {
+      // a child that shares the pages until we're done.
+      if(pipe(fds) < 0){
+        printf("%s: pipe failed\n", s);
+        exit(1);
+      }
+      if((pid = fork()) < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0){
+        close(fds[1]);
+        read(fds[0], &c, 1);
+        exit(0);
+      }
+      close(fds[0]);
+    }
+    thrgo = 0;
+    for(i = 0; i < NTHR; i++){
+      if(thread_create(thrstore, (void*)(uint64)i) < 0){
+        printf("%s: thread_create failed\n", s);
+        exit(1);
+      }
+    }
+    thrgo = 1;
+    for(i = 0; i < NTHR; i++){
+      if(thread_join() < 0){
+        printf("%s: thread_join failed\n", s);
+        exit(1);
+      }
+    }
+    for(int pg = 0; pg < NFPAGE; pg++){
+      for(i = 0; i < NTHR; i++){
+        if(thrpages[pg*PGSIZE + i] != i + 1){
+          printf("%s: round %d: store to page %d lost\n", s, round, pg);
+          exit(1);
+        }
+      }
+    }
+    if(round == 1){
+      close(fds[1]);
+      wait(0);
+    }
+  }
+}
+
+// mutexes and condition variables between threads.
+#define FUTEXN 2000
+struct mutex fxlock;
+struct cond fxcond;
+int fxcount;
+int fxitem, fxfull;
+int fxsum;
+
+void
+fxadder(void *a)
+{
+  for(int i = 0; i < FUTEXN; i++){
+    mutex_lock(&fxlock);
+    fxcount++;
+    mutex_unlock(&fxlock);
+  }
+}
+
+void
+fxconsumer(void *a)
+{
+  for(int i = 0; i < FUTEXN; i++){
+    mutex_lock(&fxlock);
+    while(!fxfull)
+      cond_wait(&fxcond, &fxlock);
+    fxsum += fxitem;
+    fxfull = 0;
+    cond_broadcast(&fxcond);
+    mutex_unlock(&fxlock);
+  }
+}
+
+void
+futextest(char *s)
+{
+  uint w = 1;
+
+  if(futex_wait(&w, 0) != -1){
+    printf("%s: futex_wait on a changed word slept\n", s);
+    exit(1);
+  }
+  if(futex_wake(&w, 1) != 0){
+    printf("%s: futex_wake woke someone\n", s);
+    exit(1);
+  }
+
+  mutex_init(&fxlock);
+  for(int i = 0; i < NTHR; i++){
+    if(thread_create(fxadder, 0) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < NTHR; i++)
+    thread_join();
+  if(fxcount != NTHR * FUTEXN){
+    printf("%s: count %d, want %d\n", s, fxcount, NTHR * FUTEXN);
+    exit(1);
+  }
+
+  // pass FUTEXN items, one at a time, to another thread.
+  cond_init(&fxcond);
+  if(thread_create(fxconsumer, 0) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  for(int i = 1; i <= FUTEXN; i++){
+    mutex_lock(&fxlock);
+    while(fxfull)
+      cond_wait(&fxcond, &fxlock);
+    fxitem = i;
+    fxfull = 1;
+    cond_broadcast(&fxcond);
+    mutex_unlock(&fxlock);
+  }
+  thread_join();
+  if(fxsum != FUTEXN * (FUTEXN + 1) / 2){
+    printf("%s: sum %d, want %d\n", s, fxsum, FUTEXN * (FUTEXN + 1) / 2);
+    exit(1);
+  }
+}
+
+// a fork() makes the pages of a waiting thread's condition
+// variable copy-on-write again, so that the signaller's next
+// store moves the word to a new page; the waiter must still
+// be woken.
+struct mutex fklock;
+struct cond fkcond;
+volatile int fkready, fkflag, fkdone;
+
+void
+fkwaiter(void *a)
+{
+  mutex_lock(&fklock);
+  fkready = 1;
+  while(!fkflag)
+    cond_wait(&fkcond, &fklock);
+  mutex_unlock(&fklock);
+  fkdone = 1;
+}
+
+void
+futexforktest(char *s)
+{
+  int pid, t0;
+
+  mutex_init(&fklock);
+  cond_init(&fkcond);
+  if(thread_create(fkwaiter, 0) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  while(!fkready)
+    ;
+  // fkready is set with fklock held; once we have it, the
+  // waiter is asleep in cond_wait().
+  mutex_lock(&fklock);
+  mutex_unlock(&fklock);
+  sleep(2);
+
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+
+  mutex_lock(&fklock);
+  fkflag = 1;
+  cond_signal(&fkcond);
+  mutex_unlock(&fklock);
+  t0 = uptime();
+  while(!fkdone){
+    if(uptime() - t0 > 20){
+      printf("%s: waiter not woken after fork\n", s);
+      exit(1);
+    }
+    sleep(1);
+  }
+  thread_join();
+}
+
+// lockstat() reports each lock name once, and counts what
+// happens to it.
+struct lockstat lsbefore[NLOCKSTAT], lsafter[NLOCKSTAT];
+
+void
+lockstattest(char *s)
+{
+  int n0, n, i, j;
+
+  if((n0 = lockstat(lsbefore, NLOCKSTAT)) <= 0){
+    printf("%s: lockstat failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 100; i++)
+    uptime();
+  if((n = lockstat(lsafter, NLOCKSTAT)) < n0){
+    printf("%s: lockstat lost lock names\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    for(j = i + 1; j < n; j++){
+      if(strcmp(lsafter[i].name, lsafter[j].name) == 0){
+        printf("%s: lock name %s twice\n", s, lsafter[i].name);
+        exit(1);
+      }
+    }
+  }
+  for(i = 0; i < n0; i++){
+    if(strcmp(lsbefore[i].name, "time") == 0)
+      break;
+  }
+  if(i == n0 || lsafter[i].nacquire < lsbefore[i].nacquire + 100){
+    printf("%s: uptime()'s lock not counted\n", s);
+    exit(1);
+  }
+}
+
+// regression test. test whether exec() leaks memory if one of the
+// arguments is invalid. the test passes if the kernel doesn't panic.
+void
+badarg(char *s)
+{
+  for(int i = 0; i < 50000; i++){
+    char *argv[2];
+    argv[0] = (char*)0xffffffff;
+    argv[1] = 0;
+    exec("echo", argv);
+  }
+  
+  exit(0);
+}
+
+// several processes read a file at once, in pieces that
+// don't line up with blocks, while readi() reads ahead of
+// them; each must see what was written.
+#define RABLOCKS 120
+
+void
+readaheadtest(char *s)
+{
+  int fd, i, n, pid, off;
+  char file[] = "ratest";
+
+  unlink(file);
+  if((fd = open(file, O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < RABLOCKS; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  for(int k = 0; k < 3; k++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if((fd = open(file, O_RDONLY)) < 0){
+        printf("%s: open failed\n", s);
+        exit(1);
+      }
+      off = 0;
+      while((n = read(fd, buf, 700 + 100*k)) > 0){
+        for(i = 0; i < n; i++, off++){
+          if((uchar)buf[i] != (uchar)(off / BSIZE)){
+            printf("%s: wrong byte at %d\n", s, off);
+            exit(1);
+          }
+        }
+      }
+      if(n < 0 || off != RABLOCKS*BSIZE){
+        printf("%s: read %d bytes\n", s, off);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  for(int k = 0; k < 3; k++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  unlink(file);
 }
 
 struct test {
@@ -2633,6 +3659,8 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
+  {cowcopyout, "cowcopyout"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
@@ -2649,6 +3677,22 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {lazysbrk, "lazysbrk"},
+  {demandexec, "demandexec"},
+  {memstats, "memstats"},
+  {manyfiles, "manyfiles"},
+  {megapages, "megapages"},
+  {mmaptest, "mmaptest"},
+  {schedstats, "schedstats"},
+  {nicetest, "nicetest"},
+  {pipecrowd, "pipecrowd"},
+  {nanosleeptest, "nanosleeptest"},
+  {threadtest, "threadtest"},
+  {threadfaulttest, "threadfaulttest"},
+  {futextest, "futextest"},
+  {futexforktest, "futexforktest"},
+  {lockstattest, "lockstattest"},
+  {readaheadtest, "readaheadtest"},
   {badarg, "badarg" },
 
   { 0, 0},
@@ -36,3 +36,15 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("memstat");
+entry("mmap");
+entry("munmap");
+entry("schedstat");
+entry("nice");
+entry("setpriority");
+entry("nanosleep");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("lockstat");